@@ -16,7 +16,8 @@ list *listCreate(void) {
 	return list;
 }
 
-void listRelease(list *list) {
+/* 释放所有节点, 保留链表本身 */
+void listEmpty(list *list) {
 	unsigned long len;
 	listNode *current, *next;
 
@@ -28,6 +29,12 @@ void listRelease(list *list) {
 		zfree(current);
 		current = next;
 	}
+	list->head = list->tail = NULL;
+	list->len = 0;
+}
+
+void listRelease(list *list) {
+	listEmpty(list);
 	zfree(list);
 }
 
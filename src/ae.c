@@ -1,3 +1,4 @@
+#include "fmacroc.h"
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -7,11 +8,22 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "ae.h"
 #include "zmalloc.h"
 #include "config.h"
 
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+/* pendingMask 中的标志位: fd 已经在顺延列表中 */
+#define AE_PENDING_QUEUED 4
+
+#ifdef HAVE_IOURING
+#include "ae_iouring.c"
+#else
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
@@ -25,6 +37,13 @@
 		#endif
 	#endif
 #endif
+#endif
+
+static long long aeMonotonicUs(void);
+static void aeDeleteTaskQueue(aeEventLoop *eventLoop);
+static unsigned long long aeMonotonicNs(void);
+static void aeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te);
+static void aeFreeTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te);
 
 aeEventLoop *aeCreateEventLoop(int setsize)
 {
@@ -34,18 +53,44 @@ aeEventLoop *aeCreateEventLoop(int setsize)
 	if ((eventLoop = zmalloc(sizeof(*eventLoop))) == NULL) goto err;
 	eventLoop->events = zmalloc(sizeof(aeFileEvent) * setsize);
 	eventLoop->fired = zmalloc(sizeof(aeFiredEvent) * setsize);
-	if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
+	eventLoop->pending = zmalloc(sizeof(int) * setsize);
+	if (eventLoop->events == NULL || eventLoop->fired == NULL || eventLoop->pending == NULL) goto err;
+	eventLoop->pendingCount = 0;
+	eventLoop->dontWait = 0;
+	eventLoop->maxCallbacks = 0;
+	eventLoop->maxIterationUs = 0;
 	eventLoop->setsize = setsize;
-	eventLoop->lastTime = time(NULL);
-	eventLoop->timeEventHead = NULL;
+	eventLoop->now_us = aeMonotonicUs();
+	eventLoop->timeEventHeap = NULL;
+	eventLoop->timeEventHeapSize = 0;
+	eventLoop->timeEventHeapCap = 0;
+	eventLoop->timeEventSlots = NULL;
+	eventLoop->timeEventSlotsCap = 0;
+	eventLoop->timeEventFreeSlot = -1;
 	eventLoop->timeEventNextId = 0;
+	eventLoop->timeEventNextSeq = 0;
 	eventLoop->stop = 0;
 	eventLoop->maxfd = -1;
 	eventLoop->beforesleep = NULL;
+	eventLoop->stats = NULL;
+	eventLoop->taskStub.next = NULL;
+	eventLoop->taskHead = eventLoop->taskTail = &eventLoop->taskStub;
+	eventLoop->taskfd[0] = eventLoop->taskfd[1] = -1;
+	eventLoop->taskWakeup = 0;
+	memset(&eventLoop->busyPoll, 0, sizeof(eventLoop->busyPoll));
+	eventLoop->wheel = NULL;
+	eventLoop->lastPollEvents = 0;
+	eventLoop->bgTasks = NULL;
+	eventLoop->bgNextId = 0;
+	eventLoop->bgTimerId = -1;
+	eventLoop->bgPeriodMs = AE_BG_DEFAULT_PERIOD_MS;
+	eventLoop->bgRunning = 0;
 	if (aeApiCreate(eventLoop) == -1) goto err;
 
 	for (i = 0; i < setsize; i++) {
 		eventLoop->events[i].mask = AE_NONE;
+		eventLoop->events[i].pendingMask = AE_NONE;
+		eventLoop->events[i].efileProc = NULL;
 	}
 
 	return eventLoop;
@@ -54,6 +99,7 @@ err:
 	if (eventLoop) {
 		zfree(eventLoop->events);
 		zfree(eventLoop->fired);
+		zfree(eventLoop->pending);
 		zfree(eventLoop);
 	}
 	return NULL;
@@ -73,11 +119,14 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize)
 	if (aeApiResize(eventLoop, setsize) == -1) return AE_ERR;
 
 	eventLoop->events = zrealloc(eventLoop->events, sizeof(aeFileEvent) * setsize);
-	eventLoop->fired  = zrealloc(eventLoop->events, sizeof(aeFiredEvent) * setsize);
+	eventLoop->fired  = zrealloc(eventLoop->fired, sizeof(aeFiredEvent) * setsize);
+	eventLoop->pending = zrealloc(eventLoop->pending, sizeof(int) * setsize);
 	eventLoop->setsize = setsize;
 
 	for (i = eventLoop->maxfd + 1; i < setsize; i++) {
 		eventLoop->events[i].mask = AE_NONE;
+		eventLoop->events[i].pendingMask = AE_NONE;
+		eventLoop->events[i].efileProc = NULL;
 	}
 
 	return AE_OK;
@@ -85,9 +134,25 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize)
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop)
 {
+	aeDeleteTaskQueue(eventLoop);
+	while (eventLoop->bgTasks) {
+		aeBgTask *task = eventLoop->bgTasks;
+		eventLoop->bgTasks = task->next;
+		zfree(task);
+	}
+	while (eventLoop->timeEventHeapSize) {
+		aeTimeEvent *te = eventLoop->timeEventHeap[0];
+		aeHeapRemove(eventLoop, te);
+		aeFreeTimeEvent(eventLoop, te);
+	}
+	zfree(eventLoop->timeEventHeap);
+	zfree(eventLoop->timeEventSlots);
+	zfree(eventLoop->wheel);
+	zfree(eventLoop->stats);
 	aeApiFree(eventLoop);
 	zfree(eventLoop->events);
 	zfree(eventLoop->fired);
+	zfree(eventLoop->pending);
 	zfree(eventLoop);
 }
 
@@ -108,6 +173,7 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask, aeFileProc *proc
 	fe->mask |= mask;
 	if (mask & AE_READABLE) fe->rfileProc = proc;
 	if (mask & AE_WRITABLE) fe->wfileProc = proc;
+	if (mask & AE_ERRQUEUE) fe->efileProc = proc;
 	fe->clientData = clientData;
 	if (fd > eventLoop->maxfd) {
 		eventLoop->maxfd = fd;
@@ -124,6 +190,8 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
 
 	aeApiDelEvent(eventLoop, fd, mask);
 	fe->mask = fe->mask & (~mask);
+	fe->pendingMask &= ~mask;
+	if (mask & AE_ERRQUEUE) fe->efileProc = NULL;
 	if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
 		int j;
 		for (j = eventLoop->maxfd - 1; j >= 0; j--) {
@@ -133,6 +201,14 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
 	}
 }
 
+int aeSetEdgeTriggered(aeEventLoop *eventLoop, int enable)
+{
+	// 必须在注册任何文件事件之前切换
+	if (eventLoop->maxfd != -1) return AE_ERR;
+	if (aeApiSetEdgeTriggered(eventLoop, enable) == -1) return AE_ERR;
+	return AE_OK;
+}
+
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd)
 {
 	if (fd >= eventLoop->setsize) return 0;
@@ -141,134 +217,1045 @@ int aeGetFileEvents(aeEventLoop *eventLoop, int fd)
 	return fe->mask;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
+/* 单调时钟, 不受系统时间调整的影响 */
+static long long aeMonotonicUs(void)
 {
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#else
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
-	*seconds = tv.tv_sec;
-	*milliseconds = tv.tv_usec / 1000;
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+#endif
+}
+
+static unsigned long long aeMonotonicNs(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+	return (unsigned long long)aeMonotonicUs() * 1000;
+#endif
+}
+
+static void aeUpdateTime(aeEventLoop *eventLoop)
+{
+	eventLoop->now_us = aeMonotonicUs();
+}
+
+/* 每轮循环缓存的当前时间(微秒), 回调中使用它可以避免重复读取时钟 */
+long long aeNow(aeEventLoop *eventLoop)
+{
+	return eventLoop->now_us;
+}
+
+/*------------------------- 跨线程任务 -----------------------------*/
+
+/* 入队可以在任意线程执行: 交换队尾后再链接, 无锁且不会失败 */
+static void aeTaskPush(aeEventLoop *eventLoop, aeTask *task)
+{
+	aeTask *prev;
+
+	__atomic_store_n(&task->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&eventLoop->taskTail, task, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, task, __ATOMIC_RELEASE);
+}
+
+/* 只在事件循环线程执行, 生产者正在链接时返回 NULL, 剩余任务会随下一次唤醒处理 */
+static aeTask *aeTaskPop(aeEventLoop *eventLoop)
+{
+	aeTask *head = eventLoop->taskHead;
+	aeTask *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+	if (head == &eventLoop->taskStub) {
+		if (next == NULL) return NULL;
+		eventLoop->taskHead = head = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		eventLoop->taskHead = next;
+		return head;
+	}
+	if (head != __atomic_load_n(&eventLoop->taskTail, __ATOMIC_ACQUIRE)) return NULL;
+	// 队列只剩最后一个任务, 放回占位节点后才能把它取出
+	aeTaskPush(eventLoop, &eventLoop->taskStub);
+	next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		eventLoop->taskHead = next;
+		return head;
+	}
+	return NULL;
+}
+
+static void aeTaskQueueHandler(aeEventLoop *eventLoop, int fd, void *clientData, int mask)
+{
+	char buf[64];
+	aeTask *task;
+
+	AE_NOTUSED(clientData);
+	AE_NOTUSED(mask);
+	while (read(fd, buf, sizeof(buf)) > 0);
+	// 先清除标志再取任务, 之后入队的生产者会重新写唤醒信号
+	__atomic_store_n(&eventLoop->taskWakeup, 0, __ATOMIC_SEQ_CST);
+	while ((task = aeTaskPop(eventLoop)) != NULL) {
+		task->proc(eventLoop, task->arg);
+		zfree(task);
+	}
+}
+
+/* 每个事件循环单独开启, maxUs 为 0 时关闭 */
+void aeSetBusyPoll(aeEventLoop *eventLoop, long long maxUs)
+{
+	aeBusyPoll *bp = &eventLoop->busyPoll;
+
+	bp->maxUs = maxUs > 0 ? maxUs : 0;
+	if (bp->windowUs > bp->maxUs) bp->windowUs = bp->maxUs;
+}
+
+aeBusyPoll *aeGetBusyPoll(aeEventLoop *eventLoop)
+{
+	return &eventLoop->busyPoll;
+}
+
+/*------------------------------------------------------------------
+ * 后台任务调度
+ *-----------------------------------------------------------------*/
+
+// 执行期间删除的任务只做标记, 全部执行完再释放
+static void aeSweepBgTasks(aeEventLoop *eventLoop)
+{
+	aeBgTask **link = &eventLoop->bgTasks;
+
+	while (*link) {
+		aeBgTask *task = *link;
+		if (task->deleted) {
+			*link = task->next;
+			zfree(task);
+		} else {
+			link = &task->next;
+		}
+	}
+	if (eventLoop->bgTasks == NULL && eventLoop->bgTimerId != -1) {
+		aeDeleteTimeEvent(eventLoop, eventLoop->bgTimerId);
+		eventLoop->bgTimerId = -1;
+	}
+}
+
+/*
+ * fromTimer 为 0 时在 beforesleep 中调用, 只在循环空闲时
+ * 继续执行还有积压的任务.
+ */
+static int aeRunBgTasks(aeEventLoop *eventLoop, int fromTimer)
+{
+	int idle = eventLoop->lastPollEvents == 0, processed = 0, deleted = 0;
+	aeBgTask *task;
+
+	if (eventLoop->bgTasks == NULL || eventLoop->bgRunning) return 0;
+	if (!fromTimer && !idle) return 0;
+
+	eventLoop->bgRunning = 1;
+	for (task = eventLoop->bgTasks; task; task = task->next) {
+		long long budget, start, used;
+		int retval;
+
+		if (task->deleted || (!fromTimer && !task->behindSinceUs)) continue;
+		// 周期越短时间片越小, 每秒占用的时间保持不变
+		budget = task->sliceUs * eventLoop->bgPeriodMs / AE_BG_DEFAULT_PERIOD_MS;
+		if (budget < 1) budget = 1;
+		if (fromTimer && idle) budget *= AE_BG_IDLE_FACTOR;
+
+		start = aeMonotonicUs();
+		retval = task->proc(eventLoop, budget, task->clientData);
+		used = aeMonotonicUs() - start;
+		processed++;
+
+		task->runs++;
+		task->usedUs += used;
+		if ((unsigned long long)used > task->maxRunUs) task->maxRunUs = used;
+		if (retval == AE_BG_MORE) {
+			task->behind++;
+			if (!task->behindSinceUs) task->behindSinceUs = start;
+			if (start + used - task->behindSinceUs > task->maxLagUs) {
+				task->maxLagUs = start + used - task->behindSinceUs;
+			}
+		} else {
+			task->behindSinceUs = 0;
+		}
+	}
+	eventLoop->bgRunning = 0;
+
+	for (task = eventLoop->bgTasks; task; task = task->next) deleted |= task->deleted;
+	if (deleted) aeSweepBgTasks(eventLoop);
+	return processed;
+}
+
+static int aeBgTimerProc(struct aeEventLoop *eventLoop, long long id, void *clientData)
+{
+	AE_NOTUSED(id);
+	AE_NOTUSED(clientData);
+
+	aeRunBgTasks(eventLoop, 1);
+	return eventLoop->bgTimerId == -1 ? AE_NOMORE : eventLoop->bgPeriodMs;
+}
+
+/*
+ * 优先级相同的按注册顺序执行. sliceUs 是周期为 AE_BG_DEFAULT_PERIOD_MS 时的时间片,
+ * 周期变化时按比例缩放.
+ */
+long long aeCreateBgTask(aeEventLoop *eventLoop, const char *name, int priority, long long sliceUs, aeBgProc *proc, void *clientData)
+{
+	aeBgTask *task, **link;
+
+	if (sliceUs <= 0) return AE_ERR;
+	if ((task = zmalloc(sizeof(*task))) == NULL) return AE_ERR;
+	if (eventLoop->bgTimerId == -1) {
+		eventLoop->bgTimerId = aeCreateTimeEvent(eventLoop, eventLoop->bgPeriodMs, aeBgTimerProc, NULL, NULL);
+		if (eventLoop->bgTimerId == AE_ERR) {
+			eventLoop->bgTimerId = -1;
+			zfree(task);
+			return AE_ERR;
+		}
+	}
+
+	memset(task, 0, sizeof(*task));
+	task->id = eventLoop->bgNextId++;
+	task->name = name;
+	task->priority = priority;
+	task->sliceUs = sliceUs;
+	task->proc = proc;
+	task->clientData = clientData;
+
+	link = &eventLoop->bgTasks;
+	while (*link && (*link)->priority >= priority) link = &(*link)->next;
+	task->next = *link;
+	*link = task;
+	return task->id;
+}
+
+int aeDeleteBgTask(aeEventLoop *eventLoop, long long id)
+{
+	aeBgTask *task;
+
+	for (task = eventLoop->bgTasks; task; task = task->next) {
+		if (task->id == id && !task->deleted) {
+			task->deleted = 1;
+			if (!eventLoop->bgRunning) aeSweepBgTasks(eventLoop);
+			return AE_OK;
+		}
+	}
+	return AE_ERR;
+}
+
+/* 定时执行后台任务的周期, 下一次触发后生效 */
+void aeSetBgPeriod(aeEventLoop *eventLoop, long long milliseconds)
+{
+	eventLoop->bgPeriodMs = milliseconds > 0 ? milliseconds : 1;
+}
+
+aeBgTask *aeGetBgTasks(aeEventLoop *eventLoop)
+{
+	return eventLoop->bgTasks;
+}
+
+/* 当前积压了多久(微秒), 没有积压返回 0 */
+long long aeBgTaskLag(aeEventLoop *eventLoop, aeBgTask *task)
+{
+	if (!task->behindSinceUs) return 0;
+	return eventLoop->now_us - task->behindSinceUs;
+}
+
+/* 在事件循环线程中调用一次, 注册唤醒 fd 后其他线程才能投递任务 */
+int aeCreateTaskQueue(aeEventLoop *eventLoop)
+{
+	if (eventLoop->taskfd[0] != -1) return AE_OK;
+#ifdef HAVE_EVENTFD
+	eventLoop->taskfd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eventLoop->taskfd[0] == -1) return AE_ERR;
+	eventLoop->taskfd[1] = eventLoop->taskfd[0];
+#else
+	if (pipe(eventLoop->taskfd) == -1) return AE_ERR;
+	fcntl(eventLoop->taskfd[0], F_SETFL, O_NONBLOCK);
+	fcntl(eventLoop->taskfd[1], F_SETFL, O_NONBLOCK);
+#endif
+	if (aeCreateFileEvent(eventLoop, eventLoop->taskfd[0], AE_READABLE,
+		aeTaskQueueHandler, NULL) == AE_ERR) {
+		aeDeleteTaskQueue(eventLoop);
+		return AE_ERR;
+	}
+	return AE_OK;
+}
+
+static void aeDeleteTaskQueue(aeEventLoop *eventLoop)
+{
+	aeTask *task;
+
+	if (eventLoop->taskfd[0] == -1) return;
+	aeDeleteFileEvent(eventLoop, eventLoop->taskfd[0], AE_READABLE);
+	while ((task = aeTaskPop(eventLoop)) != NULL) zfree(task);
+	close(eventLoop->taskfd[0]);
+	if (eventLoop->taskfd[1] != eventLoop->taskfd[0]) close(eventLoop->taskfd[1]);
+	eventLoop->taskfd[0] = eventLoop->taskfd[1] = -1;
+}
+
+/*
+ * 线程安全: 任务在事件循环线程中执行. 两次 poll 之间的多次投递
+ * 只会写一次唤醒 fd.
+ */
+int aePostTask(aeEventLoop *eventLoop, aeTaskProc *proc, void *arg)
+{
+	aeTask *task;
+
+	if (eventLoop->taskfd[1] == -1) return AE_ERR;
+	if ((task = zmalloc(sizeof(*task))) == NULL) return AE_ERR;
+	task->proc = proc;
+	task->arg = arg;
+	aeTaskPush(eventLoop, task);
+
+	if (__atomic_exchange_n(&eventLoop->taskWakeup, 1, __ATOMIC_SEQ_CST) == 0) {
+#ifdef HAVE_EVENTFD
+		uint64_t one = 1;
+		if (write(eventLoop->taskfd[1], &one, sizeof(one)) == -1) {
+			/* 计数器已满也说明有未处理的唤醒 */
+		}
+#else
+		if (write(eventLoop->taskfd[1], "x", 1) == -1) {
+			/* 管道已满也说明有未处理的唤醒 */
+		}
+#endif
+	}
+	return AE_OK;
+}
+
+/*------------------------- 统计 ---------------------------------*/
+
+/* 单线程写入, 原子存储保证其他线程读到的值不会被撕裂 */
+static void aeStatsIncr(unsigned long long *p, unsigned long long delta)
+{
+	__atomic_store_n(p, *p + delta, __ATOMIC_RELAXED);
+}
+
+static int aeHistogramIndex(unsigned long long value)
+{
+	int msb;
+
+	if (value < AE_HIST_SUB_BUCKETS) return (int)value;
+	msb = 63 - __builtin_clzll(value);
+	return (msb - AE_HIST_SUB_BITS + 1) * AE_HIST_SUB_BUCKETS +
+		(int)((value >> (msb - AE_HIST_SUB_BITS)) & (AE_HIST_SUB_BUCKETS - 1));
+}
+
+/* 桶的上界, 百分位数按上界报告 */
+static unsigned long long aeHistogramBucketValue(int index)
+{
+	int shift;
+
+	if (index < AE_HIST_SUB_BUCKETS) return index;
+	shift = index / AE_HIST_SUB_BUCKETS - 1;
+	return ((unsigned long long)(AE_HIST_SUB_BUCKETS + index % AE_HIST_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void aeHistogramRecord(aeHistogram *h, unsigned long long value)
+{
+	aeStatsIncr(&h->buckets[aeHistogramIndex(value)], 1);
+	aeStatsIncr(&h->count, 1);
+	aeStatsIncr(&h->sum, value);
+	if (value > h->max) __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+unsigned long long aeHistogramPercentile(aeHistogram *h, double percentile)
+{
+	unsigned long long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	unsigned long long target, seen = 0;
+	int j;
+
+	if (count == 0) return 0;
+	target = (unsigned long long)(count * percentile / 100);
+	if (target == 0) target = 1;
+	for (j = 0; j < AE_HIST_BUCKETS; j++) {
+		seen += __atomic_load_n(&h->buckets[j], __ATOMIC_RELAXED);
+		if (seen >= target) {
+			unsigned long long value = aeHistogramBucketValue(j);
+			unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+			return value < max ? value : max;
+		}
+	}
+	return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+/* 记录一次文件事件回调的耗时, 返回结束时间供下一个回调作为起点 */
+static unsigned long long aeStatsFileProc(aeLoopStats *stats, aeFileProc *proc, int fd, unsigned long long start)
+{
+	unsigned long long end = aeMonotonicNs();
+	unsigned long long elapsed = end - start;
+
+	aeHistogramRecord(&stats->fileProc, elapsed);
+	if (elapsed > stats->slowestFileNs) {
+		stats->slowestFileProc = proc;
+		stats->slowestFileFd = fd;
+		__atomic_store_n(&stats->slowestFileNs, elapsed, __ATOMIC_RELAXED);
+	}
+	return end;
+}
+
+static void aeStatsTimeProc(aeLoopStats *stats, aeTimeProc *proc, unsigned long long elapsed)
+{
+	aeHistogramRecord(&stats->timeProc, elapsed);
+	if (elapsed > stats->slowestTimeNs) {
+		stats->slowestTimeProc = proc;
+		__atomic_store_n(&stats->slowestTimeNs, elapsed, __ATOMIC_RELAXED);
+	}
+}
+
+void aeEnableStats(aeEventLoop *eventLoop, int enable)
+{
+	if (enable && eventLoop->stats == NULL) {
+		eventLoop->stats = zcalloc(sizeof(aeLoopStats));
+		eventLoop->stats->slowestFileFd = -1;
+	} else if (!enable && eventLoop->stats) {
+		zfree(eventLoop->stats);
+		eventLoop->stats = NULL;
+	}
+}
+
+void aeResetStats(aeEventLoop *eventLoop)
+{
+	if (eventLoop->stats == NULL) return;
+	memset(eventLoop->stats, 0, sizeof(aeLoopStats));
+	eventLoop->stats->slowestFileFd = -1;
+}
+
+aeLoopStats *aeGetStats(aeEventLoop *eventLoop)
+{
+	return eventLoop->stats;
+}
+
+static void aeLogHistogram(aeStatsLogProc *logProc, const char *name, aeHistogram *h, double scale)
+{
+	char line[256];
+	unsigned long long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+	snprintf(line, sizeof(line),
+		"%s: count=%llu avg=%.2f p50=%.2f p99=%.2f p99.9=%.2f max=%.2f",
+		name, count,
+		count ? (double)h->sum / count / scale : 0,
+		aeHistogramPercentile(h, 50) / scale,
+		aeHistogramPercentile(h, 99) / scale,
+		aeHistogramPercentile(h, 99.9) / scale,
+		__atomic_load_n(&h->max, __ATOMIC_RELAXED) / scale);
+	logProc(line);
+}
+
+/* 逐行输出统计结果, 时间单位为微秒 */
+void aeLogStats(aeEventLoop *eventLoop, aeStatsLogProc *logProc)
+{
+	aeLoopStats *stats = eventLoop->stats;
+	aeBgTask *task;
+	char line[256];
+	unsigned long proc = 0;
+
+	if (stats == NULL) return;
+	snprintf(line, sizeof(line), "event loop (%s) iterations=%llu, times in usec",
+		aeApiName(), __atomic_load_n(&stats->iterations, __ATOMIC_RELAXED));
+	logProc(line);
+	aeLogHistogram(logProc, "beforesleep", &stats->beforesleep, 1000);
+	aeLogHistogram(logProc, "poll", &stats->poll, 1000);
+	aeLogHistogram(logProc, "file proc", &stats->fileProc, 1000);
+	aeLogHistogram(logProc, "time proc", &stats->timeProc, 1000);
+	aeLogHistogram(logProc, "time events", &stats->timeEvents, 1000);
+	aeLogHistogram(logProc, "events per wakeup", &stats->eventsPerWakeup, 1);
+	if (eventLoop->busyPoll.maxUs) {
+		aeBusyPoll *bp = &eventLoop->busyPoll;
+		snprintf(line, sizeof(line),
+			"busy poll: window=%lld/%lld usec spin=%llu idle=%llu usec spin_ratio=%.3f hits=%llu misses=%llu blocking=%llu",
+			bp->windowUs, bp->maxUs, bp->spinUs, bp->idleUs,
+			(bp->spinUs + bp->idleUs) ? (double)bp->spinUs / (bp->spinUs + bp->idleUs) : 0,
+			bp->spinHits, bp->spinMisses, bp->blockingPolls);
+		logProc(line);
+	}
+
+	for (task = eventLoop->bgTasks; task; task = task->next) {
+		if (task->deleted) continue;
+		snprintf(line, sizeof(line),
+			"bg task %s: priority=%d slice=%lld runs=%llu used=%llu max_run=%llu behind=%llu lag=%lld max_lag=%lld usec",
+			task->name, task->priority, task->sliceUs, task->runs, task->usedUs,
+			task->maxRunUs, task->behind, aeBgTaskLag(eventLoop, task), task->maxLagUs);
+		logProc(line);
+	}
+
+	// ISO C 不允许函数指针直接转换为 void *
+	memcpy(&proc, &stats->slowestFileProc, sizeof(proc) < sizeof(aeFileProc *) ? sizeof(proc) : sizeof(aeFileProc *));
+	snprintf(line, sizeof(line), "slowest file proc: %.2f usec proc=0x%lx fd=%d",
+		stats->slowestFileNs / 1000.0, stats->slowestFileNs ? proc : 0, stats->slowestFileFd);
+	logProc(line);
+	memcpy(&proc, &stats->slowestTimeProc, sizeof(proc) < sizeof(aeTimeProc *) ? sizeof(proc) : sizeof(aeTimeProc *));
+	snprintf(line, sizeof(line), "slowest time proc: %.2f usec proc=0x%lx",
+		stats->slowestTimeNs / 1000.0, stats->slowestTimeNs ? proc : 0);
+	logProc(line);
+}
+
+/*------------------------- 时间事件最小堆 ---------------------------*/
+
+static int aeTimeEventLess(aeTimeEvent *a, aeTimeEvent *b)
+{
+	if (a->when_us != b->when_us) return a->when_us < b->when_us;
+	return a->seq < b->seq;
+}
+
+static void aeHeapSet(aeEventLoop *eventLoop, int index, aeTimeEvent *te)
+{
+	eventLoop->timeEventHeap[index] = te;
+	te->index = index;
+}
+
+static void aeHeapSiftUp(aeEventLoop *eventLoop, int index)
+{
+	aeTimeEvent *te = eventLoop->timeEventHeap[index];
+
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (!aeTimeEventLess(te, eventLoop->timeEventHeap[parent])) break;
+		aeHeapSet(eventLoop, index, eventLoop->timeEventHeap[parent]);
+		index = parent;
+	}
+	aeHeapSet(eventLoop, index, te);
+}
+
+static void aeHeapSiftDown(aeEventLoop *eventLoop, int index)
+{
+	aeTimeEvent *te = eventLoop->timeEventHeap[index];
+	int size = eventLoop->timeEventHeapSize;
+
+	while (1) {
+		int child = index * 2 + 1;
+		if (child >= size) break;
+		if (child + 1 < size &&
+			aeTimeEventLess(eventLoop->timeEventHeap[child + 1], eventLoop->timeEventHeap[child])) {
+			child++;
+		}
+		if (!aeTimeEventLess(eventLoop->timeEventHeap[child], te)) break;
+		aeHeapSet(eventLoop, index, eventLoop->timeEventHeap[child]);
+		index = child;
+	}
+	aeHeapSet(eventLoop, index, te);
+}
+
+static int aeHeapInsert(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+	if (eventLoop->timeEventHeapSize == eventLoop->timeEventHeapCap) {
+		int cap = eventLoop->timeEventHeapCap ? eventLoop->timeEventHeapCap * 2 : 16;
+		aeTimeEvent **heap = zrealloc(eventLoop->timeEventHeap, sizeof(aeTimeEvent*) * cap);
+		if (heap == NULL) return AE_ERR;
+		eventLoop->timeEventHeap = heap;
+		eventLoop->timeEventHeapCap = cap;
+	}
+	te->seq = eventLoop->timeEventNextSeq++;
+	aeHeapSet(eventLoop, eventLoop->timeEventHeapSize++, te);
+	aeHeapSiftUp(eventLoop, te->index);
+	return AE_OK;
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
+static void aeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te)
 {
-	long cur_sec, cur_ms, when_sec, when_ms;
-	
-	aeGetTime(&cur_sec, &cur_ms);
-	when_sec = cur_sec + milliseconds / 1000;
-	when_ms = cur_ms + milliseconds % 1000;
+	int index = te->index;
+	aeTimeEvent *last = eventLoop->timeEventHeap[--eventLoop->timeEventHeapSize];
 
-	if (when_ms >= 1000) {
-		when_sec++;
-		when_ms -= 1000;
+	te->index = -1;
+	if (last == te) return;
+	aeHeapSet(eventLoop, index, last);
+	if (index > 0 && aeTimeEventLess(last, eventLoop->timeEventHeap[(index - 1) / 2])) {
+		aeHeapSiftUp(eventLoop, index);
+	} else {
+		aeHeapSiftDown(eventLoop, index);
+	}
+}
+
+// 分配一个槽位, 槽位表按需倍增, 空闲槽位串成链表
+static int aeAllocTimeSlot(aeEventLoop *eventLoop)
+{
+	int slot;
+
+	if (eventLoop->timeEventFreeSlot == -1) {
+		int j, cap = eventLoop->timeEventSlotsCap ? eventLoop->timeEventSlotsCap * 2 : 16;
+		aeTimeSlot *slots = zrealloc(eventLoop->timeEventSlots, sizeof(aeTimeSlot) * cap);
+		if (slots == NULL) return -1;
+		for (j = eventLoop->timeEventSlotsCap; j < cap; j++) {
+			slots[j].te = NULL;
+			slots[j].nextFree = (j + 1 < cap) ? j + 1 : -1;
+		}
+		eventLoop->timeEventFreeSlot = eventLoop->timeEventSlotsCap;
+		eventLoop->timeEventSlots = slots;
+		eventLoop->timeEventSlotsCap = cap;
 	}
+	slot = eventLoop->timeEventFreeSlot;
+	eventLoop->timeEventFreeSlot = eventLoop->timeEventSlots[slot].nextFree;
+	return slot;
+}
+
+static aeTimeEvent *aeLookupTimeEvent(aeEventLoop *eventLoop, long long id)
+{
+	long long slot = id & 0xffffffffLL;
+	aeTimeEvent *te;
 
-	*sec = when_sec;
-	*ms = when_ms;
+	if (id < 0 || slot >= eventLoop->timeEventSlotsCap) return NULL;
+	te = eventLoop->timeEventSlots[slot].te;
+	return (te && te->id == id) ? te : NULL;
+}
+
+static void aeFreeTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+	int slot = (int)(te->id & 0xffffffffLL);
+
+	eventLoop->timeEventSlots[slot].te = NULL;
+	eventLoop->timeEventSlots[slot].nextFree = eventLoop->timeEventFreeSlot;
+	eventLoop->timeEventFreeSlot = slot;
+	if (te->finalizerProc) {
+		te->finalizerProc(eventLoop, te->clientData);
+	}
+	zfree(te);
 }
 
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds, aeTimeProc *proc, void *clientData, aeEventFinalizerProc *finalizerProc)
 {
-	long long id = eventLoop->timeEventNextId++;
 	aeTimeEvent *te;
+	int slot;
 
 	te = zmalloc(sizeof(*te));
 	if (te == NULL) return AE_ERR;
-	te->id = id;
-	aeAddMillisecondsToNow(milliseconds, &te->when_ms, &te->when_ms);
+	if ((slot = aeAllocTimeSlot(eventLoop)) == -1) {
+		zfree(te);
+		return AE_ERR;
+	}
+	te->id = ((eventLoop->timeEventNextId++ & 0x7fffffffLL) << 32) | slot;
+	te->when_us = eventLoop->now_us + milliseconds * 1000;
+	te->deleted = 0;
 	te->timeProc = proc;
 	te->finalizerProc = finalizerProc;
 	te->clientData = clientData;
-	te->next = eventLoop->timeEventHead;
-	eventLoop->timeEventHead = te;
-	return id;
+	eventLoop->timeEventSlots[slot].te = te;
+	if (aeHeapInsert(eventLoop, te) == AE_ERR) {
+		te->finalizerProc = NULL;
+		aeFreeTimeEvent(eventLoop, te);
+		return AE_ERR;
+	}
+	return te->id;
 }
 
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-	aeTimeEvent *te, *prev = NULL;
-	te = eventLoop->timeEventHead;
-	while (te) {
-		if (te->id == id) {
-			if (prev == NULL) {
-				eventLoop->timeEventHead = te->next;
-			} else {
-				prev->next = te->next;
-			}
-			if (te->finalizerProc) {
-				te->finalizerProc(eventLoop, te->clientData);
-			}
-		}
-		prev = te;
-		te = te->next;
-	}	
+	aeTimeEvent *te = aeLookupTimeEvent(eventLoop, id);
 
-	return AE_ERR;
+	if (te == NULL || te->deleted) return AE_ERR;
+	if (te->index == -1) {
+		// 正在执行自己的回调, 由 processTimeEvents 负责释放
+		te->deleted = 1;
+		return AE_OK;
+	}
+	aeHeapRemove(eventLoop, te);
+	aeFreeTimeEvent(eventLoop, te);
+	return AE_OK;
+}
+
+int aeGetTimeEventCount(aeEventLoop *eventLoop)
+{
+	return eventLoop->timeEventHeapSize;
 }
 
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-	aeTimeEvent *te = eventLoop->timeEventHead;
-	aeTimeEvent *nearest = NULL;
+	return eventLoop->timeEventHeapSize ? eventLoop->timeEventHeap[0] : NULL;
+}
+
+static int processTimeEvents(aeEventLoop *eventLoop)
+{
+	int processed = 0;
+	long long maxSeq, now = eventLoop->now_us;
+
+	// 本轮新建或重新入堆的事件 seq 都大于 maxSeq, 留到下一轮处理
+	maxSeq = eventLoop->timeEventNextSeq - 1;
+	while (eventLoop->timeEventHeapSize) {
+		aeTimeEvent *te = eventLoop->timeEventHeap[0];
+		int retval;
+
+		if (te->seq > maxSeq) break;
+		if (now < te->when_us) break;
+
+		aeHeapRemove(eventLoop, te);
+		if (eventLoop->stats) {
+			unsigned long long start = aeMonotonicNs();
+			retval = te->timeProc(eventLoop, te->id, te->clientData);
+			aeStatsTimeProc(eventLoop->stats, te->timeProc, aeMonotonicNs() - start);
+		} else {
+			retval = te->timeProc(eventLoop, te->id, te->clientData);
+		}
+		processed++;
+
+		if (retval != AE_NOMORE && !te->deleted) {
+			te->when_us = now + (long long)retval * 1000;
+			if (aeHeapInsert(eventLoop, te) == AE_OK) continue;
+		}
+		aeFreeTimeEvent(eventLoop, te);
+	}
+
+	return processed;
+}
+
+/*------------------------------------------------------------------
+ * 分层时间轮
+ *
+ * 第 0 层每个槽对应一个 tick, 第 n 层每个槽对应 AE_WHEEL_SLOTS^n 个 tick.
+ * 第 0 层转完一圈时, 把上一层对应槽里的定时器重新分配到下层(cascade).
+ *-----------------------------------------------------------------*/
+
+#define AE_WHEEL_MASK (AE_WHEEL_SLOTS - 1)
+#define AE_WHEEL_RESOLUTION_US (AE_WHEEL_RESOLUTION_MS * 1000LL)
+#define AE_WHEEL_MAX_TICKS ((1LL << (AE_WHEEL_BITS * AE_WHEEL_LEVELS)) - 1)
+
+static long long aeWheelNowTick(aeEventLoop *eventLoop)
+{
+	return eventLoop->now_us / AE_WHEEL_RESOLUTION_US;
+}
+
+static void aeWheelListInit(aeWheelTimer *head)
+{
+	head->prev = head->next = head;
+}
+
+static void aeWheelUnlink(aeWheelTimer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = timer->next = NULL;
+}
 
-	while (te) {
-		if (!nearest || te->when_sec < nearest->when_sec ||
-			(te->when_sec == nearest->when_sec && te->when_ms < nearest->when_ms)) {
-			nearest = te;
+static void aeWheelAppend(aeWheelTimer *head, aeWheelTimer *timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+// 根据距离当前 tick 的远近选择层级
+static void aeWheelLink(aeTimerWheel *wheel, aeWheelTimer *timer)
+{
+	long long delta = timer->expires - wheel->tick;
+	int level;
+
+	if (delta < 0) {
+		// 已经过期, 下一次推进时触发
+		delta = 0;
+		timer->expires = wheel->tick;
+	} else if (delta > AE_WHEEL_MAX_TICKS) {
+		delta = AE_WHEEL_MAX_TICKS;
+		timer->expires = wheel->tick + delta;
+	}
+	for (level = 0; level < AE_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1LL << (AE_WHEEL_BITS * (level + 1)))) break;
+	}
+	aeWheelAppend(&wheel->slots[level][(timer->expires >> (AE_WHEEL_BITS * level)) & AE_WHEEL_MASK], timer);
+}
+
+static void aeWheelCascade(aeTimerWheel *wheel)
+{
+	int level;
+
+	for (level = 1; level < AE_WHEEL_LEVELS; level++) {
+		int index = (wheel->tick >> (AE_WHEEL_BITS * level)) & AE_WHEEL_MASK;
+		aeWheelTimer *head = &wheel->slots[level][index], *timer, *next;
+
+		timer = head->next;
+		aeWheelListInit(head);
+		while (timer != head) {
+			next = timer->next;
+			aeWheelLink(wheel, timer);
+			timer = next;
 		}
-		te = te->next;
+		// 这一层也转完一圈才需要继续处理更高层
+		if (index != 0) break;
 	}
+}
 
-	return nearest;
+void aeWheelTimerInit(aeWheelTimer *timer, aeWheelProc *proc, void *clientData)
+{
+	timer->prev = timer->next = NULL;
+	timer->expires = 0;
+	timer->proc = proc;
+	timer->clientData = clientData;
 }
 
-static int processTimeEvents(aeEventLoop *eventLoop)
+/* 设置定时器, 已设置的会先取消, 保证不会提前触发 */
+int aeWheelArm(aeEventLoop *eventLoop, aeWheelTimer *timer, long long milliseconds)
+{
+	aeTimerWheel *wheel = eventLoop->wheel;
+	long long now = aeWheelNowTick(eventLoop);
+	int i, j;
+
+	if (wheel == NULL) {
+		if ((wheel = zmalloc(sizeof(*wheel))) == NULL) return AE_ERR;
+		for (i = 0; i < AE_WHEEL_LEVELS; i++) {
+			for (j = 0; j < AE_WHEEL_SLOTS; j++) aeWheelListInit(&wheel->slots[i][j]);
+		}
+		wheel->tick = now;
+		wheel->count = 0;
+		eventLoop->wheel = wheel;
+	}
+
+	if (aeWheelArmed(timer)) {
+		aeWheelUnlink(timer);
+	} else {
+		// 空闲期间不推进, 直接跳到当前时刻
+		if (wheel->count == 0 && wheel->tick < now) wheel->tick = now;
+		wheel->count++;
+	}
+	if (milliseconds < 0) milliseconds = 0;
+	timer->expires = (eventLoop->now_us + milliseconds * 1000 + AE_WHEEL_RESOLUTION_US - 1) / AE_WHEEL_RESOLUTION_US;
+	aeWheelLink(wheel, timer);
+	return AE_OK;
+}
+
+void aeWheelCancel(aeEventLoop *eventLoop, aeWheelTimer *timer)
 {
+	if (!aeWheelArmed(timer)) return;
+	aeWheelUnlink(timer);
+	eventLoop->wheel->count--;
+}
+
+int aeWheelTimerCount(aeEventLoop *eventLoop)
+{
+	return eventLoop->wheel ? eventLoop->wheel->count : 0;
+}
+
+/*
+ * 下一次需要推进时间轮的时刻(单调时钟微秒), 没有定时器时返回 -1.
+ * 只查看第 0 层, 找不到时在第 0 层转完一圈(需要 cascade)时醒来.
+ */
+static long long aeWheelNextDeadline(aeEventLoop *eventLoop)
+{
+	aeTimerWheel *wheel = eventLoop->wheel;
+	long long tick, boundary;
+
+	if (wheel == NULL || wheel->count == 0) return -1;
+	boundary = (wheel->tick | AE_WHEEL_MASK) + 1;
+	for (tick = wheel->tick; tick < boundary; tick++) {
+		aeWheelTimer *head = &wheel->slots[0][tick & AE_WHEEL_MASK];
+		if (head->next != head) break;
+	}
+	return tick * AE_WHEEL_RESOLUTION_US;
+}
+
+/* 推进到缓存的当前时刻, 到期的定时器先全部摘下再批量回调 */
+static int aeWheelAdvance(aeEventLoop *eventLoop)
+{
+	aeTimerWheel *wheel = eventLoop->wheel;
+	aeWheelTimer expired;
+	long long now;
 	int processed = 0;
-	aeTimeEvent *te;
-	long long maxId;
-	time_t now = time(NULL);
-
-	if (now < eventLoop->lastTime) {
-		te = eventLoop->timeEventHead;
-		while(te) {
-			te->when_sec = 0;
-			te = te->next;
+
+	if (wheel == NULL) return 0;
+	now = aeWheelNowTick(eventLoop);
+	if (wheel->count == 0) {
+		if (wheel->tick <= now) wheel->tick = now + 1;
+		return 0;
+	}
+
+	aeWheelListInit(&expired);
+	while (wheel->tick <= now) {
+		aeWheelTimer *head = &wheel->slots[0][wheel->tick & AE_WHEEL_MASK];
+
+		if ((wheel->tick & AE_WHEEL_MASK) == 0) aeWheelCascade(wheel);
+		if (head->next != head) {
+			head->next->prev = expired.prev;
+			expired.prev->next = head->next;
+			head->prev->next = &expired;
+			expired.prev = head->prev;
+			aeWheelListInit(head);
 		}
+		wheel->tick++;
 	}
-	eventLoop->lastTime = now;
 
-	te = eventLoop->timeEventHead;
-	maxId = eventLoop->timeEventNextId - 1;
-	while(te) {
-		long now_sec, now_ms;
-		long long id;
+	// 回调中可以重新设置自己, 也可以取消批次中其他还没回调的定时器
+	while (expired.next != &expired) {
+		aeWheelTimer *timer = expired.next;
 
-		if (te->id > maxId) {
-			te = te->next;
-			continue;
+		aeWheelUnlink(timer);
+		wheel->count--;
+		timer->proc(eventLoop, timer);
+		processed++;
+	}
+	return processed;
+}
+
+static void aeProcessFileEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+	aeFileEvent *fe = &eventLoop->events[fd];
+	int rfired = 0;
+	unsigned long long start = eventLoop->stats ? aeMonotonicNs() : 0;
+
+	// 先回收错误队列, 让写回调看到最新的完成状态
+	if (fe->mask & mask & AE_ERRQUEUE) {
+		fe->efileProc(eventLoop, fd, fe->clientData, mask);
+	}
+	if (fe->mask & mask & AE_READABLE) {
+		rfired = 1;
+		fe->rfileProc(eventLoop, fd, fe->clientData, mask);
+		if (eventLoop->stats) start = aeStatsFileProc(eventLoop->stats, fe->rfileProc, fd, start);
+	}
+	if (fe->mask & mask & AE_WRITABLE) {
+		if (!rfired || fe->wfileProc != fe->rfileProc) {
+			fe->wfileProc(eventLoop, fd, fe->clientData, mask);
+			if (eventLoop->stats) aeStatsFileProc(eventLoop->stats, fe->wfileProc, fd, start);
 		}
-		aeGetTime(&now_sec, &now_ms);
-		if (now_sec > te->when_sec ||
-			(now_sec == te->when_sec && now_ms >= te->when_ms)) {
-			int retval;
-			id = te->id;	
-			retval = te->timeProc(eventLoop, id, te->clientData);
-			processed++;
-
-			if (retval != AE_NOMORE) {
-				aeAddMillisecondsToNow(retval, &te->when_sec, &te->when_ms);
+	}
+}
+
+/* 把就绪事件顺延到下一轮, 同一个 fd 只会在列表中出现一次 */
+static void aeDeferFileEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+	aeFileEvent *fe = &eventLoop->events[fd];
+
+	if (!(fe->pendingMask & AE_PENDING_QUEUED)) {
+		eventLoop->pending[eventLoop->pendingCount++] = fd;
+	}
+	fe->pendingMask |= mask | AE_PENDING_QUEUED;
+}
+
+/*
+ * 先处理上一轮顺延下来的 fd, 再处理本轮新就绪的 fd. 超出回调数或时间预算后,
+ * 剩余的 fd 顺延到下一轮, 保证一个繁忙的连接不会饿死其他连接和定时器.
+ * 设置了时间预算时每个回调后都会刷新缓存时钟, 到期的定时器在两个回调之间处理.
+ */
+static int aeProcessFiredEvents(aeEventLoop *eventLoop, int numevents, int flags)
+{
+	int processed = 0, callbacks = 0, j;
+	int pendingCount = eventLoop->pendingCount;
+	long long deadline = 0;
+	int exhausted = 0;
+
+	if (eventLoop->maxIterationUs) deadline = eventLoop->now_us + eventLoop->maxIterationUs;
+
+	// 新就绪的 fd 如果已经在顺延列表中, 合并掩码即可
+	if (pendingCount) {
+		int n = 0;
+		for (j = 0; j < numevents; j++) {
+			aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
+			if (fe->pendingMask & AE_PENDING_QUEUED) {
+				fe->pendingMask |= eventLoop->fired[j].mask;
 			} else {
-				aeDeleteTimeEvent(eventLoop, id);
+				eventLoop->fired[n++] = eventLoop->fired[j];
 			}
-			te = eventLoop->timeEventHead;
+		}
+		numevents = n;
+	}
+
+	eventLoop->pendingCount = 0;
+	for (j = 0; j < pendingCount + numevents; j++) {
+		int fd, mask;
+
+		if (j < pendingCount) {
+			fd = eventLoop->pending[j];
+			mask = eventLoop->events[fd].pendingMask & (AE_READABLE | AE_WRITABLE | AE_ERRQUEUE);
+			eventLoop->events[fd].pendingMask = AE_NONE;
 		} else {
-			te = te->next;
+			fd = eventLoop->fired[j - pendingCount].fd;
+			mask = eventLoop->fired[j - pendingCount].mask;
+		}
+
+		if (exhausted) {
+			if (mask != AE_NONE) aeDeferFileEvent(eventLoop, fd, mask);
+			continue;
 		}
+		if (mask == AE_NONE) continue;
+
+		aeProcessFileEvent(eventLoop, fd, mask);
+		processed++;
+		callbacks++;
+
+		if (deadline) {
+			aeUpdateTime(eventLoop);
+			if ((flags & AE_TIME_EVENTS) && eventLoop->timeEventHeapSize &&
+				eventLoop->timeEventHeap[0]->when_us <= eventLoop->now_us) {
+				processed += processTimeEvents(eventLoop);
+			}
+			if (eventLoop->now_us >= deadline) exhausted = 1;
+		}
+		if (eventLoop->maxCallbacks && callbacks >= eventLoop->maxCallbacks) exhausted = 1;
 	}
 
 	return processed;
 }
 
+/* 根据最近的事件到达间隔调整自旋窗口: 间隔越短越值得自旋 */
+static void aeBusyPollArrival(aeEventLoop *eventLoop)
+{
+	aeBusyPoll *bp = &eventLoop->busyPoll;
+	long long gap = eventLoop->now_us - bp->lastEventUs;
+
+	bp->avgGapUs = bp->lastEventUs ? (bp->avgGapUs * 7 + gap) / 8 : gap;
+	bp->lastEventUs = eventLoop->now_us;
+	// 平均间隔已超过上限, 自旋基本等不到事件, 直接阻塞
+	if (bp->avgGapUs > bp->maxUs) {
+		bp->windowUs = 0;
+	} else {
+		bp->windowUs = bp->avgGapUs * 2;
+		if (bp->windowUs > bp->maxUs) bp->windowUs = bp->maxUs;
+	}
+}
+
+/*
+ * timeoutUs 为 -1 表示一直等待. 开启忙轮询时, 距上次事件到达还在自旋窗口内
+ * 就用零超时反复轮询, 窗口结束(或定时器到期)仍没有事件才转为阻塞等待.
+ */
+static int aePollEvents(aeEventLoop *eventLoop, long long timeoutUs)
+{
+	aeBusyPoll *bp = &eventLoop->busyPoll;
+	struct timeval tv;
+	long long start, now;
+	int numevents;
+
+	if (bp->maxUs && timeoutUs != 0 && bp->windowUs > 0) {
+		long long spinEnd = bp->lastEventUs + bp->windowUs;
+
+		start = aeMonotonicUs();
+		if (timeoutUs > 0 && start + timeoutUs < spinEnd) spinEnd = start + timeoutUs;
+		if (start < spinEnd) {
+			tv.tv_sec = tv.tv_usec = 0;
+			do {
+				numevents = aeApiPoll(eventLoop, &tv);
+				bp->spinPolls++;
+				now = aeMonotonicUs();
+			} while (numevents == 0 && now < spinEnd);
+			bp->spinUs += now - start;
+			if (numevents) {
+				bp->spinHits++;
+				return numevents;
+			}
+			// 自旋落空, 收缩窗口直到下一次事件到达
+			bp->spinMisses++;
+			bp->windowUs /= 2;
+			if (timeoutUs > 0) {
+				timeoutUs -= now - start;
+				if (timeoutUs < 0) timeoutUs = 0;
+			}
+		}
+	}
+
+	if (timeoutUs >= 0) {
+		tv.tv_sec = timeoutUs / 1000000;
+		tv.tv_usec = timeoutUs % 1000000;
+	}
+	if (!bp->maxUs) return aeApiPoll(eventLoop, timeoutUs >= 0 ? &tv : NULL);
+
+	start = aeMonotonicUs();
+	numevents = aeApiPoll(eventLoop, timeoutUs >= 0 ? &tv : NULL);
+	bp->idleUs += aeMonotonicUs() - start;
+	bp->blockingPolls++;
+	return numevents;
+}
+
 int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 {
 	int processed = 0, numevents;
@@ -276,59 +1263,54 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 	if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
 
 	if (eventLoop->maxfd != -1 || ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
-		int j;
 		aeTimeEvent *shortest = NULL;
-		struct timeval tv, *tvp;
-		
+		long long timeoutUs, wheelDeadline = -1;
+
 		if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT)) {
 			shortest = aeSearchNearestTimer(eventLoop);
+			wheelDeadline = aeWheelNextDeadline(eventLoop);
 		}
 
-		if (shortest) {
-			long now_sec, now_ms;
-			aeGetTime(&now_sec, &now_ms);
-			tvp = &tv;
-			tvp->tv_sec = shortest->when_sec - now_sec;
-			if (shortest->when_ms < now_ms) {
-				tvp->tv_usec = ((shortest->when_ms + 1000) - now_ms) * 1000;
-				tvp->tv_sec--;
-			} else {
-				tvp->tv_usec = (shortest->when_ms - now_ms) * 1000;
-			}
+		if (eventLoop->pendingCount || eventLoop->dontWait) {
+			// 还有顺延的就绪事件或待处理的工作, 不能阻塞
+			timeoutUs = 0;
+		} else if (shortest || wheelDeadline != -1) {
+			long long deadline = shortest ? shortest->when_us : wheelDeadline;
 
-			if (tvp->tv_sec < 0) tvp->tv_sec = 0;
-			if (tvp->tv_usec < 0) tvp->tv_usec = 0;
+			if (wheelDeadline != -1 && wheelDeadline < deadline) deadline = wheelDeadline;
+			// 计算超时要用实时时钟, 缓存值可能已落后于 beforesleep 的耗时
+			timeoutUs = deadline - aeMonotonicUs();
+			if (timeoutUs < 0) timeoutUs = 0;
 		} else {
-			if (flags & AE_DONT_WAIT) {
-				tv.tv_sec = tv.tv_usec = 0;
-				tvp = &tv;
-			} else {
-				tvp = NULL;
-			}
+			timeoutUs = (flags & AE_DONT_WAIT) ? 0 : -1;
 		}
 
-		numevents = aeApiPoll(eventLoop, tvp);
-		for (j = 0; j < numevents; j++) {
-			aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
-			int mask = eventLoop->fired[j].mask;
-			int fd = eventLoop->fired[j].fd;
-			int rfired = 0;
-
-			if (fe->mask & mask & AE_READABLE) {
-				rfired = 1;
-				fe->rfileProc(eventLoop, fd, fe->clientData, mask);
-			}
-			if (fe->mask & mask & AE_WRITABLE) {
-				if (!rfired || fe->wfileProc != fe->rfileProc) {
-					fe->wfileProc(eventLoop, fd, fe->clientData, mask);
-				}
-			}
-			processed++;
+		if (eventLoop->stats) {
+			unsigned long long start = aeMonotonicNs();
+			numevents = aePollEvents(eventLoop, timeoutUs);
+			aeHistogramRecord(&eventLoop->stats->poll, aeMonotonicNs() - start);
+			aeHistogramRecord(&eventLoop->stats->eventsPerWakeup, numevents);
+		} else {
+			numevents = aePollEvents(eventLoop, timeoutUs);
 		}
+		aeUpdateTime(eventLoop);
+		eventLoop->lastPollEvents = numevents;
+		if (numevents && eventLoop->busyPoll.maxUs) aeBusyPollArrival(eventLoop);
+		processed += aeProcessFiredEvents(eventLoop, numevents, flags);
+	} else {
+		aeUpdateTime(eventLoop);
 	}
 
 	if (flags & AE_TIME_EVENTS) {
-		processed += processTimeEvents(eventLoop);
+		if (eventLoop->stats) {
+			unsigned long long start = aeMonotonicNs();
+			processed += processTimeEvents(eventLoop);
+			processed += aeWheelAdvance(eventLoop);
+			aeHistogramRecord(&eventLoop->stats->timeEvents, aeMonotonicNs() - start);
+		} else {
+			processed += processTimeEvents(eventLoop);
+			processed += aeWheelAdvance(eventLoop);
+		}
 	}
 
 	return processed;
@@ -359,10 +1341,19 @@ int aeWait(int fd, int mask, long long milliseconds)
 void aeMain(aeEventLoop *eventLoop)
 {
 	eventLoop->stop = 0;
+	aeUpdateTime(eventLoop);
 	while (!eventLoop->stop) {
 		if (eventLoop->beforesleep != NULL) {
-			eventLoop->beforesleep(eventLoop);
+			if (eventLoop->stats) {
+				unsigned long long start = aeMonotonicNs();
+				eventLoop->beforesleep(eventLoop);
+				aeHistogramRecord(&eventLoop->stats->beforesleep, aeMonotonicNs() - start);
+			} else {
+				eventLoop->beforesleep(eventLoop);
+			}
 		}
+		aeRunBgTasks(eventLoop, 0);
+		if (eventLoop->stats) aeStatsIncr(&eventLoop->stats->iterations, 1);
 		aeProcessEvents(eventLoop, AE_ALL_EVENTS);
 	}
 }
@@ -376,3 +1367,14 @@ void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep
 {
 	eventLoop->beforesleep = beforesleep;
 }
+
+void aeSetProcessBudget(aeEventLoop *eventLoop, int maxCallbacks, long long maxIterationUs)
+{
+	eventLoop->maxCallbacks = maxCallbacks > 0 ? maxCallbacks : 0;
+	eventLoop->maxIterationUs = maxIterationUs > 0 ? maxIterationUs : 0;
+}
+
+void aeSetDontWait(aeEventLoop *eventLoop, int noWait)
+{
+	eventLoop->dontWait = noWait;
+}
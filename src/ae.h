@@ -7,6 +7,9 @@
 #define AE_NONE 0
 #define AE_READABLE 1
 #define AE_WRITABLE 2
+// 套接字错误队列可读(如零拷贝发送的完成通知), 随 EPOLLERR 一起上报, 不需要关注其他事件.
+// 只注册这一项时 fd 仍留在 poll 集合中, 例如关闭前等待零拷贝发送完成
+#define AE_ERRQUEUE 8
 
 #define AE_FILE_EVENTS 1
 #define AE_TIME_EVENTS 2
@@ -15,7 +18,14 @@
 
 #define AE_NOMORE -1
 
-#define AE_NOTUSED(v) ((void) V)
+/* 后台任务的返回值 */
+#define AE_BG_DONE 0
+#define AE_BG_MORE 1
+// 事件循环空闲时, 定时触发的后台任务时间片放大的倍数
+#define AE_BG_IDLE_FACTOR 4
+#define AE_BG_DEFAULT_PERIOD_MS 100
+
+#define AE_NOTUSED(V) ((void) V)
 
 struct aeEventLoop;
 
@@ -23,54 +33,256 @@ typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData,
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeStatsLogProc(const char *line);
+typedef void aeTaskProc(struct aeEventLoop *eventLoop, void *arg);
+typedef int aeBgProc(struct aeEventLoop *eventLoop, long long budgetUs, void *clientData);
+struct aeWheelTimer;
+typedef void aeWheelProc(struct aeEventLoop *eventLoop, struct aeWheelTimer *timer);
 
 typedef struct aeFileEvent {
 	int mask;
+	// 因超出本轮预算而顺延到下一轮处理的就绪事件
+	int pendingMask;
 	aeFileProc *rfileProc;
 	aeFileProc *wfileProc;
+	aeFileProc *efileProc;
 	void *clientData;
 } aeFileEvent;
 
 typedef struct aeTimeEvent {
 	long long id;
-	long when_sec;
-	long when_ms;
+	// 到期时间, 单调时钟微秒
+	long long when_us;
+	// 到期时间相同时按 seq 排序, 每次(重新)入堆都会分配新的 seq
+	long long seq;
+	// 在最小堆中的下标, -1 表示不在堆中(正在执行回调)
+	int index;
+	// 回调执行期间被删除, 回调返回后再释放
+	int deleted;
 	aeTimeProc *timeProc;
 	aeEventFinalizerProc *finalizerProc;
 	void *clientData;
-	struct aeTimeEvent *next;
 } aeTimeEvent;
 
+/* id 的低 32 位是槽位下标, 通过槽位表 O(1) 定位时间事件 */
+typedef struct aeTimeSlot {
+	aeTimeEvent *te;
+	int nextFree;
+} aeTimeSlot;
+
 typedef struct aeFiredEvent {
 	int fd;
 	int mask;
 } aeFiredEvent;
 
+/* 其他线程投递给事件循环执行的任务, 通过无锁的多生产者单消费者队列传递 */
+typedef struct aeTask {
+	aeTaskProc *proc;
+	void *arg;
+	struct aeTask *next;
+} aeTask;
+
+/*
+ * 后台任务: rehash、过期键清理等周期性占用 CPU 的工作. 按优先级从高到低,
+ * 每个周期在定时器中各执行一个时间片, 循环空闲时时间片放大, 并且还有剩余工作的
+ * 任务在 beforesleep 中继续执行. 回调返回 AE_BG_MORE 表示时间片内没有做完.
+ */
+typedef struct aeBgTask {
+	long long id;
+	// 不复制, 调用方保证在任务删除前有效
+	const char *name;
+	int priority;
+	// 周期为 AE_BG_DEFAULT_PERIOD_MS 时的时间片(微秒), 按实际周期等比缩放
+	long long sliceUs;
+	aeBgProc *proc;
+	void *clientData;
+	int deleted;
+	unsigned long long runs;
+	// 累计和单次最长的执行时间(微秒)
+	unsigned long long usedUs;
+	unsigned long long maxRunUs;
+	// 时间片用完仍有剩余工作的次数
+	unsigned long long behind;
+	// 开始积压的时刻, 0 表示没有积压
+	long long behindSinceUs;
+	long long maxLagUs;
+	struct aeBgTask *next;
+} aeBgTask;
+
+/*
+ * 分层时间轮, 用于客户端空闲超时这类数量多、精度要求低、经常重置的定时器.
+ * 每层 AE_WHEEL_SLOTS 个槽, 一个 tick 为 AE_WHEEL_RESOLUTION_MS 毫秒,
+ * 超出范围的超时按最大值处理. 定时器由调用方嵌入自己的结构体中,
+ * 设置、重置、取消都是 O(1).
+ */
+#define AE_WHEEL_RESOLUTION_MS 10
+#define AE_WHEEL_BITS 6
+#define AE_WHEEL_SLOTS (1 << AE_WHEEL_BITS)
+#define AE_WHEEL_LEVELS 5
+
+typedef struct aeWheelTimer {
+	// 槽位内的双向链表, next 为 NULL 表示未设置
+	struct aeWheelTimer *prev;
+	struct aeWheelTimer *next;
+	// 到期的 tick
+	long long expires;
+	aeWheelProc *proc;
+	void *clientData;
+} aeWheelTimer;
+
+typedef struct aeTimerWheel {
+	// 下一个待处理的 tick, 更早到期的都已触发
+	long long tick;
+	int count;
+	// 每个槽位的链表头
+	aeWheelTimer slots[AE_WHEEL_LEVELS][AE_WHEEL_SLOTS];
+} aeTimerWheel;
+
+/*
+ * 对数-线性分桶的直方图(HDR 风格), 每个 2 的幂区间再分 AE_HIST_SUB_BUCKETS 个子桶,
+ * 相对误差不超过 1/AE_HIST_SUB_BUCKETS. 只有事件循环线程写入,
+ * 其他线程可以随时无锁读取.
+ */
+#define AE_HIST_SUB_BITS 3
+#define AE_HIST_SUB_BUCKETS (1 << AE_HIST_SUB_BITS)
+#define AE_HIST_BUCKETS ((64 - AE_HIST_SUB_BITS + 1) * AE_HIST_SUB_BUCKETS)
+
+typedef struct aeHistogram {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned long long buckets[AE_HIST_BUCKETS];
+} aeHistogram;
+
+/* 事件循环各阶段的耗时统计, 时间单位为纳秒 */
+typedef struct aeLoopStats {
+	unsigned long long iterations;
+	aeHistogram beforesleep;
+	aeHistogram poll;
+	// 单个文件事件回调的耗时
+	aeHistogram fileProc;
+	// 单个时间事件回调的耗时
+	aeHistogram timeProc;
+	// 每轮 processTimeEvents 的总耗时
+	aeHistogram timeEvents;
+	// 每次唤醒返回的就绪 fd 数量
+	aeHistogram eventsPerWakeup;
+	// 最慢的回调
+	unsigned long long slowestFileNs;
+	aeFileProc *slowestFileProc;
+	int slowestFileFd;
+	unsigned long long slowestTimeNs;
+	aeTimeProc *slowestTimeProc;
+} aeLoopStats;
+
+/* 忙轮询: 有事件到达后的一小段时间内用零超时轮询代替阻塞等待 */
+typedef struct aeBusyPoll {
+	// 配置的最长自旋时间(微秒), 0 表示关闭
+	long long maxUs;
+	// 根据事件到达间隔自适应调整的自旋窗口
+	long long windowUs;
+	long long lastEventUs;
+	// 事件到达间隔的滑动平均
+	long long avgGapUs;
+	// 自旋和阻塞等待的累计时间(微秒)
+	unsigned long long spinUs;
+	unsigned long long idleUs;
+	unsigned long long spinPolls;
+	// 自旋期间等到事件的次数
+	unsigned long long spinHits;
+	unsigned long long spinMisses;
+	unsigned long long blockingPolls;
+} aeBusyPoll;
+
 typedef struct aeEventLoop {
 	int maxfd;
 	int setsize;
 	long long timeEventNextId;
-	time_t lastTime;
+	// 本轮循环缓存的单调时钟(微秒)
+	long long now_us;
 	aeFileEvent *events;
 	aeFiredEvent *fired;
-	aeTimeEvent *timeEventHead;
+	// 上一轮未处理完、顺延下来的就绪 fd, 下一轮优先处理
+	int *pending;
+	int pendingCount;
+	// 不为 0 时下一轮不阻塞等待, 由 beforesleep 在还有待处理的工作时设置
+	int dontWait;
+	// 每轮最多执行的文件事件回调数和时间预算(微秒), 0 表示不限制
+	int maxCallbacks;
+	long long maxIterationUs;
+	// 按到期时间排序的最小堆
+	aeTimeEvent **timeEventHeap;
+	int timeEventHeapSize;
+	int timeEventHeapCap;
+	aeTimeSlot *timeEventSlots;
+	int timeEventSlotsCap;
+	int timeEventFreeSlot;
+	long long timeEventNextSeq;
 	int stop;
 	void *apidata;
 	aeBeforeSleepProc *beforesleep;
+	// 为 NULL 时不做统计, 不产生额外的时钟读取
+	aeLoopStats *stats;
+	// 任务队列: 生产者交换 taskTail 入队, 事件循环线程从 taskHead 出队
+	aeTask *taskHead;
+	aeTask *taskTail;
+	aeTask taskStub;
+	// 唤醒用的 eventfd(不支持时为管道), 未创建任务队列时为 -1
+	int taskfd[2];
+	// 已经写过唤醒信号、事件循环还未处理
+	int taskWakeup;
+	aeBusyPoll busyPoll;
+	// 第一次设置时间轮定时器时才分配
+	aeTimerWheel *wheel;
+	// 上一次轮询返回的就绪 fd 数量, 为 0 时认为循环空闲
+	int lastPollEvents;
+	// 后台任务链表, 按优先级从高到低排列
+	aeBgTask *bgTasks;
+	long long bgNextId;
+	long long bgTimerId;
+	long long bgPeriodMs;
+	int bgRunning;
 } aeEventLoop;
 
 aeEventLoop *aeCreateEventLoop(int setsize);
 void aeDeleteEventLoop(aeEventLoop *eventLoop);
 void aeStop(aeEventLoop *eventLoop);
 int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask, aeFileProc *proc, void *clientData);
+void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
+int aeGetFileEvents(aeEventLoop *eventLoop, int fd);
+/* 边缘触发模式: 回调必须一直读/写到 EAGAIN, 否则剩余的数据不会再次通知 */
+int aeSetEdgeTriggered(aeEventLoop *eventLoop, int enable);
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds, aeTimeProc *proc, void *clientData, aeEventFinalizerProc *finalizerProc);
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id);
+int aeGetTimeEventCount(aeEventLoop *eventLoop);
+void aeWheelTimerInit(aeWheelTimer *timer, aeWheelProc *proc, void *clientData);
+int aeWheelArm(aeEventLoop *eventLoop, aeWheelTimer *timer, long long milliseconds);
+void aeWheelCancel(aeEventLoop *eventLoop, aeWheelTimer *timer);
+int aeWheelTimerCount(aeEventLoop *eventLoop);
+#define aeWheelArmed(t) ((t)->next != NULL)
+long long aeNow(aeEventLoop *eventLoop);
 int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+void aeSetProcessBudget(aeEventLoop *eventLoop, int maxCallbacks, long long maxIterationUs);
+void aeSetDontWait(aeEventLoop *eventLoop, int noWait);
+void aeSetBusyPoll(aeEventLoop *eventLoop, long long maxUs);
+aeBusyPoll *aeGetBusyPoll(aeEventLoop *eventLoop);
+long long aeCreateBgTask(aeEventLoop *eventLoop, const char *name, int priority, long long sliceUs, aeBgProc *proc, void *clientData);
+int aeDeleteBgTask(aeEventLoop *eventLoop, long long id);
+void aeSetBgPeriod(aeEventLoop *eventLoop, long long milliseconds);
+aeBgTask *aeGetBgTasks(aeEventLoop *eventLoop);
+long long aeBgTaskLag(aeEventLoop *eventLoop, aeBgTask *task);
+int aeCreateTaskQueue(aeEventLoop *eventLoop);
+int aePostTask(aeEventLoop *eventLoop, aeTaskProc *proc, void *arg);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
+void aeEnableStats(aeEventLoop *eventLoop, int enable);
+void aeResetStats(aeEventLoop *eventLoop);
+aeLoopStats *aeGetStats(aeEventLoop *eventLoop);
+unsigned long long aeHistogramPercentile(aeHistogram *h, double percentile);
+void aeLogStats(aeEventLoop *eventLoop, aeStatsLogProc *logProc);
 
 #endif
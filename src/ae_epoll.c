@@ -1,25 +1,113 @@
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+/* 超时精度: epoll_pwait2 > timerfd > 毫秒(向上取整) */
+#define AE_EPOLL_TIMEOUT_MS 0
+#define AE_EPOLL_TIMEOUT_TIMERFD 1
+#define AE_EPOLL_TIMEOUT_PWAIT2 2
+
+/* fd 标志: 已在修改列表中 / 已在补发列表中 */
+#define AE_EPOLL_CHANGED 1
+#define AE_EPOLL_READY 2
 
 typedef struct aeApiState {
 	int epfd;
 	struct epoll_event *events;
+	int timeoutMode;
+	// timerfd 模式下注册在 epoll 中的定时器, 以及它是否还没有到期
+	int tfd;
+	int timerArmed;
+	// 边缘触发模式
+	int edgeTriggered;
+	// 内核中已注册掩码的影子, AE_NONE 表示未注册
+	int *registered;
+	// 本轮被修改过、等待在 epoll_wait 前统一提交的 fd
+	int *changes;
+	int changesCount;
+	// 边缘触发模式下需要补发的事件掩码及其 fd 列表
+	int *readyMask;
+	int *ready;
+	int readyCount;
+	unsigned char *flags;
 } aeApiState;
 
+static int aeApiAllocShadow(aeApiState *state, int oldsize, int setsize)
+{
+	int j;
+
+	state->registered = zrealloc(state->registered, sizeof(int) * setsize);
+	state->changes = zrealloc(state->changes, sizeof(int) * setsize);
+	state->readyMask = zrealloc(state->readyMask, sizeof(int) * setsize);
+	state->ready = zrealloc(state->ready, sizeof(int) * setsize);
+	state->flags = zrealloc(state->flags, setsize);
+	if (!state->registered || !state->changes || !state->readyMask ||
+		!state->ready || !state->flags) return -1;
+	for (j = oldsize; j < setsize; j++) {
+		state->registered[j] = AE_NONE;
+		state->readyMask[j] = AE_NONE;
+		state->flags[j] = 0;
+	}
+	return 0;
+}
+
+static void aeApiFreeShadow(aeApiState *state)
+{
+	zfree(state->registered);
+	zfree(state->changes);
+	zfree(state->readyMask);
+	zfree(state->ready);
+	zfree(state->flags);
+}
+
+/* 运行时探测内核支持的最高精度超时机制 */
+static int aeApiProbeTimeoutMode(aeApiState *state)
+{
+#ifdef SYS_epoll_pwait2
+	struct timespec ts = {0, 0};
+	struct epoll_event ee;
+
+	if (sizeof(ts) == 16 &&
+		syscall(SYS_epoll_pwait2, state->epfd, &ee, 1, &ts, NULL, 0) != -1) {
+		return AE_EPOLL_TIMEOUT_PWAIT2;
+	}
+#endif
+	state->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (state->tfd != -1) {
+		struct epoll_event ee;
+
+		ee.events = EPOLLIN;
+		ee.data.u64 = 0;
+		ee.data.fd = state->tfd;
+		if (epoll_ctl(state->epfd, EPOLL_CTL_ADD, state->tfd, &ee) == 0) {
+			return AE_EPOLL_TIMEOUT_TIMERFD;
+		}
+		close(state->tfd);
+		state->tfd = -1;
+	}
+	return AE_EPOLL_TIMEOUT_MS;
+}
+
 static int aeApiCreate(aeEventLoop *eventLoop)
 {
-	aeApiState *state = zmalloc(sizeof(aeApiState));
+	aeApiState *state = zcalloc(sizeof(aeApiState));
 	if (!state) return -1;
 	state->events = zmalloc(sizeof(struct epoll_event) * eventLoop->setsize);
-	if (!state->events) {
+	if (!state->events || aeApiAllocShadow(state, 0, eventLoop->setsize) == -1) {
+		aeApiFreeShadow(state);
+		zfree(state->events);
 		zfree(state);
 		return -1;
 	}
 	state->epfd = epoll_create(1024);
 	if (state->epfd == -1) {
+		aeApiFreeShadow(state);
 		zfree(state->events);
 		zfree(state);
 		return -1;
 	}
+	state->tfd = -1;
+	state->timeoutMode = aeApiProbeTimeoutMode(state);
 	eventLoop->apidata = state;
 	return 0;
 }
@@ -28,7 +116,7 @@ static int aeApiResize(aeEventLoop *eventLoop, int setsize)
 {
 	aeApiState *state = eventLoop->apidata;
 	state->events = zrealloc(state->events, sizeof(struct epoll_event) * setsize);
-	return 0;	
+	return aeApiAllocShadow(state, eventLoop->setsize, setsize);
 }
 
 static void aeApiFree(aeEventLoop *eventLoop)
@@ -36,66 +124,210 @@ static void aeApiFree(aeEventLoop *eventLoop)
 	aeApiState *state = eventLoop->apidata;
 
 	close(state->epfd);
+	if (state->tfd != -1) close(state->tfd);
+	aeApiFreeShadow(state);
 	zfree(state->events);
 	zfree(state);
 }
 
-static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+static int aeApiSetEdgeTriggered(aeEventLoop *eventLoop, int enable)
 {
 	aeApiState *state = eventLoop->apidata;
+
+	state->edgeTriggered = enable;
+	return 0;
+}
+
+static int aeApiCtl(aeApiState *state, int op, int fd, int mask)
+{
 	struct epoll_event ee;
 
-	int op = eventLoop->events[fd].mask == AE_NONE ? 
-			EPOLL_CTL_ADD : EPOLL_CTL_MOD;
 	ee.events = 0;
-	mask |= eventLoop->events[fd].mask;
 	if (mask & AE_READABLE) ee.events |= EPOLLIN;
 	if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+	if (state->edgeTriggered) ee.events |= EPOLLET;
 	ee.data.u64 = 0;
 	ee.data.fd = fd;
-	if (epoll_ctl(state->epfd, op, fd, &ee) == -1) return -1;
+	return epoll_ctl(state->epfd, op, fd, &ee);
+}
+
+static void aeApiMarkReady(aeApiState *state, int fd, int mask)
+{
+	if (mask == AE_NONE) return;
+	if (!(state->flags[fd] & AE_EPOLL_READY)) {
+		state->flags[fd] |= AE_EPOLL_READY;
+		state->ready[state->readyCount++] = fd;
+	}
+	state->readyMask[fd] |= mask;
+}
+
+static void aeApiMarkChanged(aeApiState *state, int fd)
+{
+	if (state->flags[fd] & AE_EPOLL_CHANGED) return;
+	state->flags[fd] |= AE_EPOLL_CHANGED;
+	state->changes[state->changesCount++] = fd;
+}
+
+/*
+ * 首次注册立即 ADD, 以便同步返回错误; 之后的修改只记录在影子里,
+ * 在 epoll_wait 之前合并成至多一次 MOD, 同一轮内开关写事件不产生系统调用.
+ * 边缘触发模式下一次性注册读写两种事件, 之后增加关注时补发一次事件,
+ * 避免错过注册之前已经到达的边缘.
+ */
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+	aeApiState *state = eventLoop->apidata;
+	int newmask = mask | eventLoop->events[fd].mask;
 
+	if (state->registered[fd] == AE_NONE) {
+		int regmask = state->edgeTriggered ? (AE_READABLE | AE_WRITABLE) : newmask;
+		if (aeApiCtl(state, EPOLL_CTL_ADD, fd, regmask) == -1) {
+			if (errno != EEXIST || aeApiCtl(state, EPOLL_CTL_MOD, fd, regmask) == -1)
+				return -1;
+		}
+		state->registered[fd] = regmask;
+		return 0;
+	}
+
+	if (state->edgeTriggered) {
+		aeApiMarkReady(state, fd, mask & ~eventLoop->events[fd].mask);
+	} else if (state->registered[fd] != newmask) {
+		aeApiMarkChanged(state, fd);
+	}
 	return 0;
 }
 
 static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
 {
 	aeApiState *state = eventLoop->apidata;
-	struct epoll_event ee;
 	int mask = eventLoop->events[fd].mask & (~delmask);
 
-	ee.events = 0;
-	if (mask & AE_READABLE) ee.events |= EPOLLIN;
-	if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
-	ee.data.u64 = 0;
-	ee.data.fd = fd;
-	if (mask != AE_NONE) {
-		epoll_ctl(state->epfd, EPOLL_CTL_MOD, fd, &ee);
-	} else {
-		epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ee);
+	if (state->registered[fd] == AE_NONE) return;
+	if (mask == AE_NONE) {
+		// 立即删除, fd 随后可能被关闭并复用
+		aeApiCtl(state, EPOLL_CTL_DEL, fd, AE_NONE);
+		state->registered[fd] = AE_NONE;
+		state->readyMask[fd] = AE_NONE;
+	} else if (!state->edgeTriggered && state->registered[fd] != mask) {
+		aeApiMarkChanged(state, fd);
+	}
+}
+
+/* 把本轮累积的修改提交给内核, 已经与影子一致的 fd 直接跳过 */
+static void aeApiFlushChanges(aeEventLoop *eventLoop)
+{
+	aeApiState *state = eventLoop->apidata;
+	int j;
+
+	for (j = 0; j < state->changesCount; j++) {
+		int fd = state->changes[j];
+		int mask = eventLoop->events[fd].mask;
+
+		state->flags[fd] &= ~AE_EPOLL_CHANGED;
+		if (state->registered[fd] == AE_NONE || state->registered[fd] == mask) continue;
+		if (aeApiCtl(state, EPOLL_CTL_MOD, fd, mask) == -1 && errno == ENOENT) {
+			aeApiCtl(state, EPOLL_CTL_ADD, fd, mask);
+		}
+		state->registered[fd] = mask;
 	}
+	state->changesCount = 0;
+}
+
+/* 上次设置的定时器被其他事件提前唤醒后还没有到期, 不再需要时撤销, 避免一次空唤醒 */
+static void aeApiDisarmTimer(aeApiState *state)
+{
+	struct itimerspec its;
+
+	if (!state->timerArmed) return;
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(state->tfd, 0, &its, NULL);
+	state->timerArmed = 0;
+}
+
+static int aeApiWait(aeApiState *state, int setsize, struct timeval *tvp)
+{
+	long long us;
+
+	if (tvp == NULL) {
+		aeApiDisarmTimer(state);
+		return epoll_wait(state->epfd, state->events, setsize, -1);
+	}
+	us = (long long)tvp->tv_sec * 1000000 + tvp->tv_usec;
+
+#ifdef SYS_epoll_pwait2
+	if (state->timeoutMode == AE_EPOLL_TIMEOUT_PWAIT2) {
+		struct timespec ts;
+
+		ts.tv_sec = tvp->tv_sec;
+		ts.tv_nsec = tvp->tv_usec * 1000;
+		return syscall(SYS_epoll_pwait2, state->epfd, state->events, setsize, &ts, NULL, 0);
+	}
+#endif
+	if (state->timeoutMode == AE_EPOLL_TIMEOUT_TIMERFD && us % 1000) {
+		struct itimerspec its;
+
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = tvp->tv_sec;
+		its.it_value.tv_nsec = tvp->tv_usec * 1000;
+		if (timerfd_settime(state->tfd, 0, &its, NULL) == 0) {
+			state->timerArmed = 1;
+			return epoll_wait(state->epfd, state->events, setsize, -1);
+		}
+	}
+	aeApiDisarmTimer(state);
+	// 向上取整, 不足 1ms 的超时不会变成 0ms 的空转
+	return epoll_wait(state->epfd, state->events, setsize, (int)((us + 999) / 1000));
 }
 
 static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
 {
 	aeApiState *state = eventLoop->apidata;
 	int retval, numevents = 0;
+	struct timeval zero = {0, 0};
 
-	retval = epoll_wait(state->epfd, state->events, eventLoop->setsize,
-			tvp ? (tvp->tv_sec * 1000 + tvp->tv_usec / 1000) : -1);
+	aeApiFlushChanges(eventLoop);
+	// 有待补发的事件时不能阻塞
+	if (state->readyCount) tvp = &zero;
+	retval = aeApiWait(state, eventLoop->setsize, tvp);
 	if (retval > 0) {
 		int j;
-		numevents = retval;
-		for (j = 0; j < numevents; j++) {
+		for (j = 0; j < retval; j++) {
 			int mask = 0;
 			struct epoll_event *e = state->events + j;
+
+			if (e->data.fd == state->tfd) {
+				uint64_t expirations;
+				if (read(state->tfd, &expirations, sizeof(expirations)) == -1) {
+					/* 已被读取或被重新设置, 忽略 */
+				}
+				state->timerArmed = 0;
+				continue;
+			}
 			if (e->events & EPOLLIN) mask |= AE_READABLE;
 			if (e->events & EPOLLOUT) mask |= AE_WRITABLE;
-			if (e->events & EPOLLERR) mask |= AE_WRITABLE;
+			if (e->events & EPOLLERR) mask |= AE_WRITABLE | AE_ERRQUEUE;
 			if (e->events & EPOLLHUP) mask |= AE_WRITABLE;
-			eventLoop->fired[j].fd = e->data.fd;
-			eventLoop->fired[j].mask = mask;
+			if (state->readyMask[e->data.fd] != AE_NONE) {
+				mask |= state->readyMask[e->data.fd];
+				state->readyMask[e->data.fd] = AE_NONE;
+			}
+			eventLoop->fired[numevents].fd = e->data.fd;
+			eventLoop->fired[numevents].mask = mask;
+			numevents++;
+		}
+	}
+	if (state->readyCount) {
+		int j;
+		for (j = 0; j < state->readyCount; j++) {
+			int fd = state->ready[j];
+			state->flags[fd] &= ~AE_EPOLL_READY;
+			if (state->readyMask[fd] == AE_NONE) continue;
+			eventLoop->fired[numevents].fd = fd;
+			eventLoop->fired[numevents].mask = state->readyMask[fd];
+			state->readyMask[fd] = AE_NONE;
+			numevents++;
 		}
+		state->readyCount = 0;
 	}
 
 	return numevents;
@@ -0,0 +1,313 @@
+/*
+ * 基于 io_uring 的事件后端
+ *
+ * 每个关注的 fd 对应一个单次(one-shot)的 IORING_OP_POLL_ADD, 触发后在下一次
+ * aeApiPoll 时批量重新提交, 从而保持与 epoll 相同的水平触发语义.
+ * 所有新增/修改/删除操作只写入提交队列, 每轮循环只调用一次 io_uring_enter.
+ */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <stdint.h>
+
+#define AE_IOURING_ENTRIES 1024
+/* 超时和撤销请求的 user_data, 它们的完成事件直接丢弃 */
+#define AE_IOURING_IGNORE_DATA 0xffffffffffffffffULL
+
+typedef struct aeApiState {
+	int ringfd;
+
+	/* 提交队列 */
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	struct io_uring_sqe *sqes;
+	unsigned sqPending;
+
+	/* 完成队列 */
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+
+	void *sqRing;
+	void *cqRing;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	size_t sqesSize;
+
+	// 每个 fd 已提交的 poll 掩码, AE_NONE 表示未提交
+	int *armed;
+	// 每个 fd 的 poll 代数, 用来识别已撤销 poll 的过期完成事件
+	unsigned *gen;
+	// 触发过、需要在下一轮重新提交 poll 的 fd
+	int *rearm;
+	int rearmCount;
+
+	struct __kernel_timespec ts;
+} aeApiState;
+
+static int aeApiEnter(aeApiState *state, unsigned submit, unsigned wait, unsigned flags)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, state->ringfd, submit, wait, flags, NULL, 0);
+	} while (ret == -1 && errno == EINTR && wait == 0);
+	return ret;
+}
+
+static struct io_uring_sqe *aeApiGetSqe(aeApiState *state)
+{
+	unsigned head, tail = *state->sqTail;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(state->sqHead, __ATOMIC_ACQUIRE);
+	if (tail - head >= AE_IOURING_ENTRIES) {
+		// 提交队列已满, 先提交已有的请求
+		if (aeApiEnter(state, state->sqPending, 0, 0) >= 0) state->sqPending = 0;
+		head = __atomic_load_n(state->sqHead, __ATOMIC_ACQUIRE);
+		if (tail - head >= AE_IOURING_ENTRIES) return NULL;
+	}
+
+	sqe = &state->sqes[tail & *state->sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	state->sqArray[tail & *state->sqMask] = tail & *state->sqMask;
+	__atomic_store_n(state->sqTail, tail + 1, __ATOMIC_RELEASE);
+	state->sqPending++;
+	return sqe;
+}
+
+static int aeApiArm(aeApiState *state, int fd, int mask)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = aeApiGetSqe(state)) == NULL) return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = 0;
+	if (mask & AE_READABLE) sqe->poll32_events |= POLLIN;
+	if (mask & AE_WRITABLE) sqe->poll32_events |= POLLOUT;
+	sqe->user_data = ((uint64_t)(++state->gen[fd]) << 32) | (unsigned)fd;
+	state->armed[fd] = mask;
+	return 0;
+}
+
+static void aeApiDisarm(aeApiState *state, int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	if (state->armed[fd] == AE_NONE) return;
+	if ((sqe = aeApiGetSqe(state)) != NULL) {
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = ((uint64_t)state->gen[fd] << 32) | (unsigned)fd;
+		sqe->user_data = AE_IOURING_IGNORE_DATA;
+	}
+	// 代数加一, 已撤销的 poll 即使完成也会被忽略
+	state->gen[fd]++;
+	state->armed[fd] = AE_NONE;
+}
+
+static void aeApiFreeRing(aeApiState *state)
+{
+	if (state->sqes && state->sqes != MAP_FAILED) munmap(state->sqes, state->sqesSize);
+	if (state->cqRing && state->cqRing != MAP_FAILED && state->cqRing != state->sqRing)
+		munmap(state->cqRing, state->cqRingSize);
+	if (state->sqRing && state->sqRing != MAP_FAILED) munmap(state->sqRing, state->sqRingSize);
+	if (state->ringfd != -1) close(state->ringfd);
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop)
+{
+	struct io_uring_params p;
+	aeApiState *state = zcalloc(sizeof(aeApiState));
+	int j;
+
+	if (!state) return -1;
+	state->ringfd = -1;
+	state->armed = zmalloc(sizeof(int) * eventLoop->setsize);
+	state->gen = zmalloc(sizeof(unsigned) * eventLoop->setsize);
+	state->rearm = zmalloc(sizeof(int) * eventLoop->setsize);
+	for (j = 0; j < eventLoop->setsize; j++) {
+		state->armed[j] = AE_NONE;
+		state->gen[j] = 0;
+	}
+
+	memset(&p, 0, sizeof(p));
+	state->ringfd = syscall(__NR_io_uring_setup, AE_IOURING_ENTRIES, &p);
+	if (state->ringfd == -1) goto err;
+
+	state->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	state->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (state->cqRingSize > state->sqRingSize) state->sqRingSize = state->cqRingSize;
+		state->cqRingSize = state->sqRingSize;
+	}
+	state->sqRing = mmap(NULL, state->sqRingSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, state->ringfd, IORING_OFF_SQ_RING);
+	if (state->sqRing == MAP_FAILED) goto err;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		state->cqRing = state->sqRing;
+	} else {
+		state->cqRing = mmap(NULL, state->cqRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, state->ringfd, IORING_OFF_CQ_RING);
+		if (state->cqRing == MAP_FAILED) goto err;
+	}
+	state->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	state->sqes = mmap(NULL, state->sqesSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, state->ringfd, IORING_OFF_SQES);
+	if (state->sqes == MAP_FAILED) goto err;
+
+	state->sqHead = (unsigned *)((char *)state->sqRing + p.sq_off.head);
+	state->sqTail = (unsigned *)((char *)state->sqRing + p.sq_off.tail);
+	state->sqMask = (unsigned *)((char *)state->sqRing + p.sq_off.ring_mask);
+	state->sqArray = (unsigned *)((char *)state->sqRing + p.sq_off.array);
+	state->cqHead = (unsigned *)((char *)state->cqRing + p.cq_off.head);
+	state->cqTail = (unsigned *)((char *)state->cqRing + p.cq_off.tail);
+	state->cqMask = (unsigned *)((char *)state->cqRing + p.cq_off.ring_mask);
+	state->cqes = (struct io_uring_cqe *)((char *)state->cqRing + p.cq_off.cqes);
+
+	eventLoop->apidata = state;
+	return 0;
+
+err:
+	aeApiFreeRing(state);
+	zfree(state->armed);
+	zfree(state->gen);
+	zfree(state->rearm);
+	zfree(state);
+	return -1;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize)
+{
+	aeApiState *state = eventLoop->apidata;
+	int j;
+
+	state->armed = zrealloc(state->armed, sizeof(int) * setsize);
+	state->gen = zrealloc(state->gen, sizeof(unsigned) * setsize);
+	state->rearm = zrealloc(state->rearm, sizeof(int) * setsize);
+	for (j = eventLoop->setsize; j < setsize; j++) {
+		state->armed[j] = AE_NONE;
+		state->gen[j] = 0;
+	}
+	return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop)
+{
+	aeApiState *state = eventLoop->apidata;
+
+	aeApiFreeRing(state);
+	zfree(state->armed);
+	zfree(state->gen);
+	zfree(state->rearm);
+	zfree(state);
+}
+
+/* one-shot poll 本身就需要重新提交, 不支持边缘触发 */
+static int aeApiSetEdgeTriggered(aeEventLoop *eventLoop, int enable)
+{
+	AE_NOTUSED(eventLoop);
+	return enable ? -1 : 0;
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+	aeApiState *state = eventLoop->apidata;
+
+	mask |= eventLoop->events[fd].mask;
+	if (state->armed[fd] == mask) return 0;
+	aeApiDisarm(state, fd);
+	return aeApiArm(state, fd, mask);
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
+{
+	aeApiState *state = eventLoop->apidata;
+	int mask = eventLoop->events[fd].mask & (~delmask);
+
+	if (state->armed[fd] == AE_NONE) return;
+	aeApiDisarm(state, fd);
+	if (mask != AE_NONE) aeApiArm(state, fd, mask);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
+{
+	aeApiState *state = eventLoop->apidata;
+	unsigned head, tail, wait = 1;
+	int j, numevents = 0;
+
+	// 上一轮触发过的 fd 如果仍有关注的事件, 重新提交 poll
+	for (j = 0; j < state->rearmCount; j++) {
+		int fd = state->rearm[j];
+		int mask = eventLoop->events[fd].mask;
+		if (mask != AE_NONE && state->armed[fd] == AE_NONE) aeApiArm(state, fd, mask);
+	}
+	state->rearmCount = 0;
+
+	head = *state->cqHead;
+	tail = __atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE);
+	if (head != tail || (tvp && tvp->tv_sec == 0 && tvp->tv_usec == 0)) {
+		wait = 0;
+	} else if (tvp) {
+		struct io_uring_sqe *sqe = aeApiGetSqe(state);
+
+		if (sqe) {
+			// off = 1: 任意一个完成事件或超时都会结束等待
+			state->ts.tv_sec = tvp->tv_sec;
+			state->ts.tv_nsec = tvp->tv_usec * 1000;
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = (uint64_t)(uintptr_t)&state->ts;
+			sqe->len = 1;
+			sqe->off = 1;
+			sqe->user_data = AE_IOURING_IGNORE_DATA;
+		} else {
+			wait = 0;
+		}
+	}
+
+	if (state->sqPending || wait) {
+		if (aeApiEnter(state, state->sqPending, wait, wait ? IORING_ENTER_GETEVENTS : 0) >= 0) {
+			state->sqPending = 0;
+		}
+	}
+
+	head = *state->cqHead;
+	tail = __atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE);
+	while (head != tail && numevents < eventLoop->setsize) {
+		struct io_uring_cqe *cqe = &state->cqes[head & *state->cqMask];
+		int fd, mask = 0;
+
+		head++;
+		if (cqe->user_data == AE_IOURING_IGNORE_DATA) continue;
+		fd = (int)(cqe->user_data & 0xffffffff);
+		if (fd >= eventLoop->setsize || (unsigned)(cqe->user_data >> 32) != state->gen[fd]) continue;
+
+		// one-shot poll 已经消耗, 下一轮再重新提交
+		state->armed[fd] = AE_NONE;
+		state->rearm[state->rearmCount++] = fd;
+		if (cqe->res < 0) continue;
+
+		if (cqe->res & POLLIN) mask |= AE_READABLE;
+		if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+		if (cqe->res & POLLERR) mask |= AE_WRITABLE | AE_ERRQUEUE;
+		if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+		eventLoop->fired[numevents].fd = fd;
+		eventLoop->fired[numevents].mask = mask;
+		numevents++;
+	}
+	__atomic_store_n(state->cqHead, head, __ATOMIC_RELEASE);
+
+	return numevents;
+}
+
+static char *aeApiName(void)
+{
+	return "io_uring";
+}
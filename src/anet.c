@@ -0,0 +1,351 @@
+#include "fmacroc.h"
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <netdb.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "anet.h"
+
+static void anetSetError(char *err, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!err) return;
+	va_start(ap, fmt);
+	vsnprintf(err, ANET_ERR_LEN, fmt, ap);
+	va_end(ap);
+}
+
+int anetNonBlock(char *err, int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1) {
+		anetSetError(err, "fcntl(F_GETFL): %s", strerror(errno));
+		return ANET_ERR;
+	}
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		anetSetError(err, "fcntl(F_SETFL,O_NONBLOCK): %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+}
+
+#ifndef HAVE_ACCEPT4
+static int anetCloseOnExec(char *err, int fd)
+{
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		anetSetError(err, "fcntl(F_SETFD,FD_CLOEXEC): %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+}
+#endif
+
+/* interval 秒后开始探测, 大约 interval * 2 秒后判定连接断开 */
+int anetKeepAlive(char *err, int fd, int interval)
+{
+	int val = 1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val)) == -1) {
+		anetSetError(err, "setsockopt SO_KEEPALIVE: %s", strerror(errno));
+		return ANET_ERR;
+	}
+
+#ifdef __linux__
+	val = interval;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &val, sizeof(val)) < 0) {
+		anetSetError(err, "setsockopt TCP_KEEPIDLE: %s", strerror(errno));
+		return ANET_ERR;
+	}
+
+	val = interval / 3;
+	if (val == 0) val = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &val, sizeof(val)) < 0) {
+		anetSetError(err, "setsockopt TCP_KEEPINTVL: %s", strerror(errno));
+		return ANET_ERR;
+	}
+
+	val = 3;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &val, sizeof(val)) < 0) {
+		anetSetError(err, "setsockopt TCP_KEEPCNT: %s", strerror(errno));
+		return ANET_ERR;
+	}
+#else
+	((void) interval);
+#endif
+
+	return ANET_OK;
+}
+
+static int anetSetTcpNoDelay(char *err, int fd, int val)
+{
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)) == -1) {
+		anetSetError(err, "setsockopt TCP_NODELAY: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+}
+
+int anetEnableTcpNoDelay(char *err, int fd)
+{
+	return anetSetTcpNoDelay(err, fd, 1);
+}
+
+int anetDisableTcpNoDelay(char *err, int fd)
+{
+	return anetSetTcpNoDelay(err, fd, 0);
+}
+
+/* 允许在这个套接字上使用 MSG_ZEROCOPY 发送, 内核或平台不支持时返回 ANET_ERR */
+int anetEnableZeroCopy(char *err, int fd)
+{
+#if defined(HAVE_MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+	int yes = 1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == -1) {
+		anetSetError(err, "setsockopt SO_ZEROCOPY: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+#else
+	((void) fd);
+	anetSetError(err, "SO_ZEROCOPY is not supported on this platform");
+	return ANET_ERR;
+#endif
+}
+
+static int anetSetReuseAddr(char *err, int fd)
+{
+	int yes = 1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
+		anetSetError(err, "setsockopt SO_REUSEADDR: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+}
+
+/* 多个线程各自监听同一个端口, 由内核在它们之间分配新连接 */
+static int anetSetReusePort(char *err, int fd)
+{
+#ifdef SO_REUSEPORT
+	int yes = 1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+		anetSetError(err, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+#else
+	((void) fd);
+	anetSetError(err, "SO_REUSEPORT is not supported on this platform");
+	return ANET_ERR;
+#endif
+}
+
+static int anetV6Only(char *err, int fd)
+{
+	int yes = 1;
+
+	if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) == -1) {
+		anetSetError(err, "setsockopt IPV6_V6ONLY: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+}
+
+static int anetListen(char *err, int s, struct sockaddr *sa, socklen_t len, int backlog)
+{
+	if (bind(s, sa, len) == -1) {
+		anetSetError(err, "bind: %s", strerror(errno));
+		close(s);
+		return ANET_ERR;
+	}
+
+	if (listen(s, backlog) == -1) {
+		anetSetError(err, "listen: %s", strerror(errno));
+		close(s);
+		return ANET_ERR;
+	}
+	return ANET_OK;
+}
+
+static int _anetTcpServer(char *err, int port, char *bindaddr, int af, int backlog, int flags)
+{
+	int s = -1, rv;
+	char _port[6];
+	struct addrinfo hints, *servinfo, *p;
+
+	snprintf(_port, 6, "%d", port);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = af;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if ((rv = getaddrinfo(bindaddr, _port, &hints, &servinfo)) != 0) {
+		anetSetError(err, "%s", gai_strerror(rv));
+		return ANET_ERR;
+	}
+	for (p = servinfo; p != NULL; p = p->ai_next) {
+		if ((s = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) continue;
+
+		if (af == AF_INET6 && anetV6Only(err, s) == ANET_ERR) goto error;
+		if (anetSetReuseAddr(err, s) == ANET_ERR) goto error;
+		if ((flags & ANET_REUSEPORT) && anetSetReusePort(err, s) == ANET_ERR) goto error;
+		if (anetListen(err, s, p->ai_addr, p->ai_addrlen, backlog) == ANET_ERR) goto error;
+		goto end;
+	}
+	if (p == NULL) {
+		anetSetError(err, "unable to bind socket");
+		goto error;
+	}
+
+error:
+	if (s != -1) close(s);
+	s = ANET_ERR;
+end:
+	freeaddrinfo(servinfo);
+	return s;
+}
+
+int anetTcpServer(char *err, int port, char *bindaddr, int backlog, int flags)
+{
+	return _anetTcpServer(err, port, bindaddr, AF_INET, backlog, flags);
+}
+
+int anetTcp6Server(char *err, int port, char *bindaddr, int backlog, int flags)
+{
+	return _anetTcpServer(err, port, bindaddr, AF_INET6, backlog, flags);
+}
+
+int anetUnixServer(char *err, char *path, mode_t perm, int backlog)
+{
+	int s;
+	struct sockaddr_un sa;
+
+	if ((s = socket(AF_LOCAL, SOCK_STREAM, 0)) == -1) {
+		anetSetError(err, "creating socket: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_LOCAL;
+	strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+	if (anetListen(err, s, (struct sockaddr *)&sa, sizeof(sa), backlog) == ANET_ERR) {
+		return ANET_ERR;
+	}
+	if (perm) chmod(sa.sun_path, perm);
+	return s;
+}
+
+/*
+ * 接受一个连接, 新连接直接是非阻塞、close-on-exec 的.
+ * 没有待接受的连接时返回 ANET_ERR 且 errno 为 EAGAIN/EWOULDBLOCK.
+ */
+static int anetGenericAccept(char *err, int s, struct sockaddr *sa, socklen_t *len)
+{
+	int fd;
+
+	while (1) {
+#ifdef HAVE_ACCEPT4
+		fd = accept4(s, sa, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		fd = accept(s, sa, len);
+#endif
+		if (fd == -1) {
+			if (errno == EINTR) continue;
+			anetSetError(err, "accept: %s", strerror(errno));
+			return ANET_ERR;
+		}
+		break;
+	}
+
+#ifndef HAVE_ACCEPT4
+	if (anetNonBlock(err, fd) == ANET_ERR || anetCloseOnExec(err, fd) == ANET_ERR) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return ANET_ERR;
+	}
+#endif
+	return fd;
+}
+
+int anetTcpAccept(char *err, int s, char *ip, size_t ip_len, int *port)
+{
+	int fd;
+	struct sockaddr_storage sa;
+	socklen_t salen = sizeof(sa);
+
+	if ((fd = anetGenericAccept(err, s, (struct sockaddr *)&sa, &salen)) == ANET_ERR) {
+		return ANET_ERR;
+	}
+
+	if (sa.ss_family == AF_INET) {
+		struct sockaddr_in *s = (struct sockaddr_in *)&sa;
+		if (ip) inet_ntop(AF_INET, (void *)&(s->sin_addr), ip, ip_len);
+		if (port) *port = ntohs(s->sin_port);
+	} else {
+		struct sockaddr_in6 *s = (struct sockaddr_in6 *)&sa;
+		if (ip) inet_ntop(AF_INET6, (void *)&(s->sin6_addr), ip, ip_len);
+		if (port) *port = ntohs(s->sin6_port);
+	}
+	return fd;
+}
+
+int anetUnixAccept(char *err, int s)
+{
+	struct sockaddr_un sa;
+	socklen_t salen = sizeof(sa);
+
+	return anetGenericAccept(err, s, (struct sockaddr *)&sa, &salen);
+}
+
+int anetPeerToString(int fd, char *ip, size_t ip_len, int *port)
+{
+	struct sockaddr_storage sa;
+	socklen_t salen = sizeof(sa);
+
+	if (getpeername(fd, (struct sockaddr *)&sa, &salen) == -1) goto error;
+	if (ip_len == 0) goto error;
+
+	if (sa.ss_family == AF_INET) {
+		struct sockaddr_in *s = (struct sockaddr_in *)&sa;
+		if (ip) inet_ntop(AF_INET, (void *)&(s->sin_addr), ip, ip_len);
+		if (port) *port = ntohs(s->sin_port);
+	} else if (sa.ss_family == AF_INET6) {
+		struct sockaddr_in6 *s = (struct sockaddr_in6 *)&sa;
+		if (ip) inet_ntop(AF_INET6, (void *)&(s->sin6_addr), ip, ip_len);
+		if (port) *port = ntohs(s->sin6_port);
+	} else if (sa.ss_family == AF_UNIX) {
+		if (ip) strncpy(ip, "/unixsocket", ip_len);
+		if (port) *port = 0;
+	} else {
+		goto error;
+	}
+	return 0;
+
+error:
+	if (ip) {
+		if (ip_len >= 2) {
+			ip[0] = '?';
+			ip[1] = '\0';
+		} else if (ip_len == 1) {
+			ip[0] = '\0';
+		}
+	}
+	if (port) *port = 0;
+	return -1;
+}
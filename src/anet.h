@@ -0,0 +1,29 @@
+#ifndef ANET_H
+#define ANET_H
+
+#define ANET_OK 0
+#define ANET_ERR -1
+#define ANET_ERR_LEN 256
+
+/* Flags used with certain functions. */
+#define ANET_NONE 0
+#define ANET_IP_ONLY (1<<0)
+#define ANET_REUSEPORT (1<<1)
+
+#if defined(__sun) || defined(_AIX)
+#define AF_LOCAL AF_UNIX
+#endif
+
+int anetNonBlock(char *err, int fd);
+int anetEnableTcpNoDelay(char *err, int fd);
+int anetDisableTcpNoDelay(char *err, int fd);
+int anetKeepAlive(char *err, int fd, int interval);
+int anetEnableZeroCopy(char *err, int fd);
+int anetTcpServer(char *err, int port, char *bindaddr, int backlog, int flags);
+int anetTcp6Server(char *err, int port, char *bindaddr, int backlog, int flags);
+int anetUnixServer(char *err, char *path, mode_t perm, int backlog);
+int anetTcpAccept(char *err, int serversock, char *ip, size_t ip_len, int *port);
+int anetUnixAccept(char *err, int serversock);
+int anetPeerToString(int fd, char *ip, size_t ip_len, int *port);
+
+#endif
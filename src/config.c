@@ -86,6 +86,70 @@ void loadServerConfigFromString(char *config)
 			if (server.tcpkeepalive < 0) {
 				err = "Invalid tcp-keepalive value"; goto loaderr;
 			}
+		} else if (!strcasecmp(argv[0], "hz") && argc == 2) {
+			server.config_hz = atoi(argv[1]);
+			if (server.config_hz < REDIS_MIN_HZ) server.config_hz = REDIS_MIN_HZ;
+			if (server.config_hz > REDIS_MAX_HZ) server.config_hz = REDIS_MAX_HZ;
+		} else if (!strcasecmp(argv[0], "dynamic-hz") && argc == 2) {
+			if ((server.dynamic_hz = yesnotoi(argv[1])) == -1) {
+				err = "argument must be 'yes' or 'no'"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "dynamic-hz-min") && argc == 2) {
+			server.hz_min = atoi(argv[1]);
+			if (server.hz_min < REDIS_MIN_HZ || server.hz_min > REDIS_MAX_HZ) {
+				err = "Invalid dynamic-hz-min value"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "dynamic-hz-max") && argc == 2) {
+			server.hz_max = atoi(argv[1]);
+			if (server.hz_max < REDIS_MIN_HZ || server.hz_max > REDIS_MAX_HZ) {
+				err = "Invalid dynamic-hz-max value"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "busy-poll-us") && argc == 2) {
+			server.busy_poll_us = strtoll(argv[1], NULL, 10);
+			if (server.busy_poll_us < 0) {
+				err = "busy-poll-us can't be negative"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "io-threads") && argc == 2) {
+			server.io_threads_num = atoi(argv[1]);
+			if (server.io_threads_num < 1 || server.io_threads_num > REDIS_IO_THREADS_MAX_NUM) {
+				err = "Invalid number of I/O threads"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "io-threads-do-reads") && argc == 2) {
+			if ((server.io_threads_do_reads = yesnotoi(argv[1])) == -1) {
+				err = "argument must be 'yes' or 'no'"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "shards") && argc == 2) {
+			server.shards = atoi(argv[1]);
+			if (server.shards < 1 || server.shards > REDIS_MAX_SHARDS) {
+				err = "Invalid number of shards"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "client-output-buffer-limit") && argc == 5) {
+			int class = getClientTypeByName(argv[1]);
+			unsigned long long hard, soft;
+			int soft_seconds;
+
+			if (class == -1) {
+				err = "Invalid client class specified in buffer limit configuration."; goto loaderr;
+			}
+			hard = memtoll(argv[2], NULL);
+			soft = memtoll(argv[3], NULL);
+			soft_seconds = atoi(argv[4]);
+			if (soft_seconds < 0) {
+				err = "Negative number of seconds in soft limit is invalid"; goto loaderr;
+			}
+			server.client_obuf_limits[class].hard_limit_bytes = hard;
+			server.client_obuf_limits[class].soft_limit_bytes = soft;
+			server.client_obuf_limits[class].soft_limit_seconds = soft_seconds;
+		} else if (!strcasecmp(argv[0], "client-output-buffer-pause-reads") && argc == 2) {
+			if ((server.client_obuf_pause_reads = yesnotoi(argv[1])) == -1) {
+				err = "argument must be 'yes' or 'no'"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "zerocopy-threshold") && argc == 2) {
+			long long threshold = memtoll(argv[1], NULL);
+			if (threshold < 0) {
+				err = "zerocopy-threshold can't be negative"; goto loaderr;
+			}
+			server.zerocopy_threshold = threshold;
 		} else if (!strcasecmp(argv[0], "port") && argc == 2) {
 			server.port = atoi(argv[1]);
 			if (server.port < 0 || server.port > 65535) {
@@ -22,6 +22,21 @@
 
 #ifdef __linux__
 #define HAVE_EPOLL 1
+#define HAVE_EVENTFD 1
+#define HAVE_ACCEPT4 1
+#endif
+
+// 零拷贝发送(SO_ZEROCOPY/MSG_ZEROCOPY)需要 4.14 以上的内核
+#ifdef __linux__
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+#define HAVE_MSG_ZEROCOPY 1
+#endif
+#endif
+
+// io_uring 需要在编译时通过 USE_IOURING=yes 显式开启
+#if defined(__linux__) && defined(USE_IOURING)
+#define HAVE_IOURING 1
 #endif
 
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
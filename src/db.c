@@ -0,0 +1,118 @@
+#include "redis.h"
+
+/*------------------------------------------------------------------
+ * 键空间访问
+ *-----------------------------------------------------------------*/
+
+sds tmpKeyInit(tmpKey *tk, const char *ptr, size_t len)
+{
+	struct sdshdr *sh;
+
+	if (len > REDIS_TMPKEY_LEN) {
+		tk->key = sdsnewlen(ptr, len);
+		return tk->key;
+	}
+	sh = (struct sdshdr *)tk->space;
+	sh->len = len;
+	sh->free = 0;
+	memcpy(sh->buf, ptr, len);
+	sh->buf[len] = '\0';
+	tk->key = sh->buf;
+	return tk->key;
+}
+
+void tmpKeyFree(tmpKey *tk)
+{
+	if (tk->key != ((struct sdshdr *)tk->space)->buf) sdsfree(tk->key);
+}
+
+/* 键在数据库字典中的哈希值, 流水线批量执行前用来预取 */
+unsigned int dbHashKey(redisDb *db, const protoArg *key)
+{
+	unsigned int h;
+	tmpKey tk;
+
+	h = dictHashKey(db->dict, tmpKeyInit(&tk, key->ptr, key->len));
+	tmpKeyFree(&tk);
+	return h;
+}
+
+/* 在 dict 中查找键, hash 不为 NULL 时是已经算好的哈希值(流水线预取), 不再重复计算 */
+static dictEntry *dbFind(redisDb *db, const protoArg *key, const unsigned int *hash)
+{
+	dictEntry *de;
+	tmpKey tk;
+
+	tmpKeyInit(&tk, key->ptr, key->len);
+	de = hash ? dictFindWithHash(db->dict, tk.key, *hash) : dictFind(db->dict, tk.key);
+	tmpKeyFree(&tk);
+	return de;
+}
+
+robj *lookupKey(redisDb *db, const protoArg *key, const unsigned int *hash)
+{
+	dictEntry *de = dbFind(db, key, hash);
+
+	return de ? dictGetVal(de) : NULL;
+}
+
+/*
+ * 批量查找 count 个键, 值依次写入 vals, 不存在的为 NULL.
+ * 用 dictFindBatch 先预取再比较, 多个键的内存访问延迟互相重叠.
+ */
+void lookupKeys(redisDb *db, const protoArg *keys, int count, robj **vals)
+{
+	tmpKey tk[DICT_FIND_BATCH];
+	const void *k[DICT_FIND_BATCH];
+	dictEntry *de[DICT_FIND_BATCH];
+	int i, j, n;
+
+	for (i = 0; i < count; i += n) {
+		n = count - i < DICT_FIND_BATCH ? count - i : DICT_FIND_BATCH;
+		for (j = 0; j < n; j++) k[j] = tmpKeyInit(&tk[j], keys[i + j].ptr, keys[i + j].len);
+		dictFindBatch(db->dict, k, n, de);
+		for (j = 0; j < n; j++) {
+			vals[i + j] = de[j] ? dictGetVal(de[j]) : NULL;
+			tmpKeyFree(&tk[j]);
+		}
+	}
+}
+
+/* 键不存在时添加, 存在时替换旧值. val 的引用转移给数据库, hash 同 lookupKey */
+void setKey(redisDb *db, const protoArg *key, const unsigned int *hash, robj *val)
+{
+	dictEntry *de = dbFind(db, key, hash);
+
+	if (de) {
+		robj *old = dictGetVal(de);
+
+		dictSetVal(db->dict, de, val);
+		decrRefCount(old);
+	} else {
+		dictAdd(db->dict, sdsnewlen(key->ptr, key->len), val);
+	}
+}
+
+int dbDelete(redisDb *db, const protoArg *key)
+{
+	tmpKey tk;
+	int retval;
+
+	retval = dictDelete(db->dict, tmpKeyInit(&tk, key->ptr, key->len));
+	tmpKeyFree(&tk);
+	return retval == DICT_OK;
+}
+
+/*------------------------------------------------------------------
+ * 键空间命令
+ *-----------------------------------------------------------------*/
+
+void delCommand(redisClient *c)
+{
+	int deleted = 0, j;
+
+	for (j = 1; j < c->argc; j++) {
+		if (dbDelete(c->db, &c->argv[j])) deleted++;
+	}
+	addReplyLongLong(c, deleted);
+}
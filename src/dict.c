@@ -138,7 +138,7 @@ int dictExpand(dict *d, unsigned long size)
 
 	n.size = realsize;
 	n.sizemask = realsize - 1;
-	n.table = zmalloc(realsize * sizeof(dictEntry*));
+	n.table = zcalloc(realsize * sizeof(dictEntry*));
 	n.used = 0;
 
 	if (d->ht[0].table == NULL) {
@@ -175,7 +175,7 @@ int dictRehash(dict *d, int n)
 			unsigned int h;
 
 			nextde = de->next;
-			h = dictHashKey(d, de->key) * d->ht[1].sizemask;
+			h = dictHashKey(d, de->key) & d->ht[1].sizemask;
 			de->next = d->ht[1].table[h];
 			d->ht[1].table[h] = de;
 			d->ht[0].used--;
@@ -363,14 +363,11 @@ void dictRelease(dict *d)
 	zfree(d);
 }
 
-dictEntry *dictFind(dict *d, const void *key)
+static dictEntry *_dictFindWithHash(dict *d, const void *key, unsigned int h)
 {
 	dictEntry *he;
-	unsigned int h, idx, table;
+	unsigned int idx, table;
 
-	if (d->ht[0].size == 0) return NULL;
-	if (dictIsRehashing(d)) _dictRehashStep(d);
-	h = dictHashKey(d, key);
 	for (table = 0; table <= 1; table++) {
 		idx = h & d->ht[table].sizemask;
 		he = d->ht[table].table[idx];
@@ -385,6 +382,52 @@ dictEntry *dictFind(dict *d, const void *key)
 	return NULL;
 }
 
+dictEntry *dictFind(dict *d, const void *key)
+{
+	if (d->ht[0].size == 0) return NULL;
+	if (dictIsRehashing(d)) _dictRehashStep(d);
+	return _dictFindWithHash(d, key, dictHashKey(d, key));
+}
+
+/* 同 dictFind, h 是调用方已经算好的 dictHashKey(d, key) */
+dictEntry *dictFindWithHash(dict *d, const void *key, unsigned int h)
+{
+	if (d->ht[0].size == 0) return NULL;
+	if (dictIsRehashing(d)) _dictRehashStep(d);
+	return _dictFindWithHash(d, key, h);
+}
+
+/*
+ * 查找 n 个键, 结果依次写入 out, 不存在的为 NULL, 返回找到的数量.
+ * 每 DICT_FIND_BATCH 个键一组: 先计算全部哈希值并预取桶, 再分两轮预取
+ * 节点和键值, 最后才比较键, 一组键的缓存未命中互相重叠.
+ */
+unsigned int dictFindBatch(dict *d, const void **keys, unsigned int n, dictEntry **out)
+{
+	unsigned int h[DICT_FIND_BATCH], i, j, m, found = 0;
+	int step;
+
+	if (d->ht[0].size == 0) {
+		for (i = 0; i < n; i++) out[i] = NULL;
+		return 0;
+	}
+	if (dictIsRehashing(d)) _dictRehashStep(d);
+	for (i = 0; i < n; i += m) {
+		m = n - i < DICT_FIND_BATCH ? n - i : DICT_FIND_BATCH;
+		for (j = 0; j < m; j++) {
+			h[j] = dictHashKey(d, keys[i + j]);
+			dictPrefetch(d, h[j], DICT_PREFETCH_BUCKET);
+		}
+		for (step = DICT_PREFETCH_ENTRY; step <= DICT_PREFETCH_KEY; step++) {
+			for (j = 0; j < m; j++) dictPrefetch(d, h[j], step);
+		}
+		for (j = 0; j < m; j++) {
+			if ((out[i + j] = _dictFindWithHash(d, keys[i + j], h[j])) != NULL) found++;
+		}
+	}
+	return found;
+}
+
 void *dictFetchValue(dict *d, const void *key)
 {
 	dictEntry *he;
@@ -393,6 +436,34 @@ void *dictFetchValue(dict *d, const void *key)
 	return he ? dictGetVal(he) : NULL;
 }
 
+/*
+ * 分步预取哈希值为 h 的键: DICT_PREFETCH_BUCKET 预取桶, DICT_PREFETCH_ENTRY
+ * 预取桶中的第一个节点, DICT_PREFETCH_KEY 预取节点的键和值. 每一步只读取上一步
+ * 预取过的内存, 对一批键依次执行每一步, 这批键的缓存未命中就能互相重叠.
+ */
+void dictPrefetch(dict *d, unsigned int h, int step)
+{
+	unsigned int table;
+
+	for (table = 0; table <= 1; table++) {
+		dictht *ht = &d->ht[table];
+		dictEntry *he;
+
+		if (ht->size == 0) break;
+		if (step == DICT_PREFETCH_BUCKET) {
+			dictPrefetchAddr(&ht->table[h & ht->sizemask]);
+		} else if ((he = ht->table[h & ht->sizemask]) != NULL) {
+			if (step == DICT_PREFETCH_ENTRY) {
+				dictPrefetchAddr(he);
+			} else {
+				dictPrefetchAddr(he->key);
+				dictPrefetchAddr(he->v.val);
+			}
+		}
+		if (!dictIsRehashing(d)) break;
+	}
+}
+
 long long dictFingerprint(dict *d)
 {
 	long long intergers[6], hash = 0;
@@ -480,6 +551,38 @@ dictEntry *dictNext(dictIterator *iter)
 	return NULL;
 }
 
+/*
+ * 顺序遍历桶 i 时预取后面的桶: 第 i+DICT_ITER_PREFETCH_DISTANCE 个桶的第一个节点,
+ * 以及第 i+DICT_ITER_PREFETCH_DISTANCE/2 个桶的节点的键和值(节点已经在前面预取过).
+ */
+static void _dictPrefetchAhead(dictht *ht, unsigned long i)
+{
+	unsigned long far = i + DICT_ITER_PREFETCH_DISTANCE, near = i + DICT_ITER_PREFETCH_DISTANCE / 2;
+	dictEntry *he;
+
+	if (far < ht->size && (he = ht->table[far]) != NULL) dictPrefetchAddr(he);
+	if (near < ht->size && (he = ht->table[near]) != NULL) {
+		dictPrefetchAddr(he->key);
+		dictPrefetchAddr(he->v.val);
+	}
+}
+
+/*
+ * 同 dictNext, 每进入一个新的桶就预取后面桶中的节点和键值,
+ * 适合遍历远大于缓存的字典. 遍历期间字典不能修改(安全迭代器除外).
+ */
+dictEntry *dictNextPrefetch(dictIterator *iter)
+{
+	dictEntry *de = dictNext(iter);
+
+	if (de) {
+		dictht *ht = &iter->d->ht[iter->table];
+
+		if (ht->table[iter->index] == de) _dictPrefetchAhead(ht, iter->index);
+	}
+	return de;
+}
+
 void dictReleaseIterator(dictIterator *iter)
 {
 	if (!(iter->index == -1 && iter->table == 0)) {
@@ -61,6 +61,20 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 
 #define DICT_HT_INITIAL_SIZE 4
 
+/* dictPrefetch 的步骤 */
+#define DICT_PREFETCH_BUCKET 0
+#define DICT_PREFETCH_ENTRY 1
+#define DICT_PREFETCH_KEY 2
+// dictFindBatch 每组的键数量, 顺序遍历时提前预取的桶数
+#define DICT_FIND_BATCH 16
+#define DICT_ITER_PREFETCH_DISTANCE 16
+
+#ifdef __GNUC__
+#define dictPrefetchAddr(p) __builtin_prefetch(p)
+#else
+#define dictPrefetchAddr(p) ((void)(p))
+#endif
+
 #define dictFreeVal(d, entry) \
 	if ((d)->type->valDestructor) \
 		(d)->type->valDestructor((d)->privdata, (entry)->v.val)
@@ -116,7 +130,10 @@ int dictRehashMilliseconds(dict *d, int ms);
 int dictAdd(dict *d, void *key, void *val);
 dictEntry *dictAddRaw(dict *d, void *key);
 dictEntry *dictFind(dict *d, const void *key);
+dictEntry *dictFindWithHash(dict *d, const void *key, unsigned int h);
 void *dictFetchValue(dict *d, const void *key);
+unsigned int dictFindBatch(dict *d, const void **keys, unsigned int n, dictEntry **out);
+void dictPrefetch(dict *d, unsigned int h, int step);
 int dictReplace(dict *d, void *key, void *val);
 dictEntry *dictReplaceRaw(dict *d, void *key);
 int dictDelete(dict *ht, const void *key);
@@ -126,6 +143,7 @@ long long dictFingerprint(dict *d);
 dictIterator *dictGetIterator(dict *d);
 dictIterator *dictGetSafeIterator(dict *d);
 dictEntry *dictNext(dictIterator *iter);
+dictEntry *dictNextPrefetch(dictIterator *iter);
 void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *d);
 int dictGetRandomKeys(dict *d, dictEntry **des, unsigned int count);
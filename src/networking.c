@@ -0,0 +1,1539 @@
+#include "redis.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifdef HAVE_MSG_ZEROCOPY
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
+// 内核头文件支持而 libc 还没有定义 MSG_ZEROCOPY 时同样不使用零拷贝
+#if defined(HAVE_MSG_ZEROCOPY) && !defined(MSG_ZEROCOPY)
+#undef HAVE_MSG_ZEROCOPY
+#endif
+
+static void clientIdleTimeout(aeEventLoop *el, aeWheelTimer *timer);
+static void freeReplyBlock(void *ptr);
+static void releaseZeroCopySends(redisClient *c);
+
+// 所有分片的连接总数, 用于检查 maxclients
+static long connected_clients = 0;
+
+/*------------------------------------------------------------------
+ * 客户端的创建与释放
+ *-----------------------------------------------------------------*/
+
+/*
+ * 池中的客户端结构体保留空的回复链表和解析器的参数数组,
+ * 复用时不需要再分配, 只有池满了被释放时才一起释放.
+ */
+static void destroyClient(void *ptr)
+{
+	redisClient *c = ptr;
+
+	listRelease(c->reply);
+	protoParserFree(&c->parser);
+	zfree(c);
+}
+
+static redisClient *allocClient(void)
+{
+	redisClient *c = poolGet(&server.client_pool);
+
+	if (c == NULL) {
+		c = zmalloc(sizeof(redisClient));
+		c->reply = listCreate();
+		listSetFreeMethod(c->reply, freeReplyBlock);
+		protoParserInit(&c->parser);
+	}
+	return c;
+}
+
+/* 回收已经 freeClient 过的客户端结构体 */
+void recycleClient(redisClient *c)
+{
+	if (!poolPut(&server.client_pool, c)) destroyClient(c);
+}
+
+/* 标准大小的查询缓冲区可以容纳一次 read(), 第一次读取时不需要扩容 */
+#define isStandardQueryBuffer(qb) (sdslen(qb) + sdsavail(qb) == REDIS_IOBUF_LEN)
+
+static sds allocQueryBuffer(void)
+{
+	sds qb = poolGet(&server.querybuf_pool);
+
+	if (qb == NULL) {
+		qb = sdsnewlen(NULL, REDIS_IOBUF_LEN);
+		sdsclear(qb);
+	}
+	return qb;
+}
+
+/* 标准大小的缓冲区放回池中, 变大了的直接释放 */
+static void releaseQueryBuffer(sds qb)
+{
+	if (isStandardQueryBuffer(qb)) {
+		sdsclear(qb);
+		if (poolPut(&server.querybuf_pool, qb)) return;
+	}
+	sdsfree(qb);
+}
+
+static void destroyQueryBuffer(void *ptr)
+{
+	sdsfree(ptr);
+}
+
+/* 每个池最多保留 maxclients 个空闲对象, 分片时平分 */
+void initClientPools(void)
+{
+	unsigned long cap = server.maxclients / server.shards;
+
+	if (cap == 0) cap = 1;
+	poolInit(&server.client_pool, cap, destroyClient);
+	poolInit(&server.querybuf_pool, cap, destroyQueryBuffer);
+	poolInit(&server.reply_pool, cap, NULL);
+	server.querybuf_shared = allocQueryBuffer();
+}
+
+/*
+ * 客户端平时不持有查询缓冲区(querybuf 为 NULL), 在事件循环线程中读取时
+ * 先读到线程共享的缓冲区, 命令执行完以后:
+ * - 共享缓冲区中剩下半条命令时复制到私有缓冲区, 下次接着读;
+ * - 私有缓冲区读空后马上释放.
+ * 绝大多数时间空闲的连接因此不占用查询缓冲区.
+ */
+static void resetClientQueryBuffer(redisClient *c)
+{
+	if (c->querybuf == NULL) return;
+	if (c->querybuf == server.querybuf_shared) {
+		size_t remaining = sdslen(c->querybuf);
+
+		c->querybuf = remaining ? sdsnewlen(server.querybuf_shared, remaining) : NULL;
+		sdsclear(server.querybuf_shared);
+	} else if (sdslen(c->querybuf) == 0) {
+		releaseQueryBuffer(c->querybuf);
+		c->querybuf = NULL;
+	}
+}
+
+/*
+ * 每秒调用一次: 收回空闲客户端查询缓冲区中多余的空间,
+ * 并收缩这段时间里没有用到的空闲池.
+ */
+void clientsCron(void)
+{
+	listNode *ln;
+	listIter li;
+
+	listRewind(server.clients, &li);
+	while ((ln = listNext(&li)) != NULL) {
+		redisClient *c = listNodeValue(ln);
+
+		// 读到一半的命令留在私有缓冲区中, 扩容留下的空闲部分比数据还大时收回
+		if (c->querybuf && sdsavail(c->querybuf) > sdslen(c->querybuf) &&
+			server.unixtime - c->lastinteraction >= REDIS_QUERYBUF_IDLE_SECS) {
+			c->querybuf = sdsRemoveFreeSpace(c->querybuf);
+		}
+	}
+	poolTrim(&server.client_pool);
+	poolTrim(&server.querybuf_pool);
+	poolTrim(&server.reply_pool);
+}
+
+/*
+ * fd 为 -1 时创建不对应连接的伪客户端, 用于在分片之间代为执行命令,
+ * 伪客户端的回复留在输出缓冲区中由调用方取走.
+ */
+redisClient *createClient(int fd, int flags)
+{
+	redisClient *c = allocClient();
+
+	if (fd != -1 && aeCreateFileEvent(server.el, fd, AE_READABLE, readQueryFromClient, c) == AE_ERR) {
+		close(fd);
+		recycleClient(c);
+		return NULL;
+	}
+
+	c->id = server.next_client_id;
+	server.next_client_id += server.shards;
+	c->fd = fd;
+	c->flags = flags;
+	c->db = &server.db[0];
+	c->querybuf = NULL;
+	c->argv = NULL;
+	c->argc = 0;
+	c->ctime = c->lastinteraction = server.unixtime;
+	aeWheelTimerInit(&c->idleTimer, clientIdleTimeout, c);
+	if (fd != -1 && server.maxidletime) aeWheelArm(server.el, &c->idleTimer, (long long)server.maxidletime * 1000);
+	c->reply_bytes = 0;
+	c->reply_memory = 0;
+	c->obuf_soft_limit_reached_time = 0;
+	c->sentlen = 0;
+	c->bufpos = 0;
+	c->node = NULL;
+	if (fd != -1) {
+		listAddNodeTail(server.clients, c);
+		c->node = listLast(server.clients);
+		__atomic_add_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+	}
+	c->pending_write_node = NULL;
+	c->pending_read_node = NULL;
+	c->close_asap_node = NULL;
+	c->pending_resume_node = NULL;
+	c->io_nread = c->io_nwritten = 0;
+	c->io_errno = 0;
+	c->io_zerocopy_obj = NULL;
+	c->zerocopy_pending = NULL;
+	c->zerocopy_next_id = 0;
+	c->zerocopy_threshold = 0;
+	c->keyhash = NULL;
+	return c;
+}
+
+void freeClient(redisClient *c)
+{
+	if (c->fd != -1) {
+		aeDeleteFileEvent(server.el, c->fd, AE_READABLE);
+		aeDeleteFileEvent(server.el, c->fd, AE_WRITABLE);
+		aeDeleteFileEvent(server.el, c->fd, AE_ERRQUEUE);
+		// 还有零拷贝发送没完成时直接复位连接, 内核丢弃队列中的数据, 对象可以马上释放
+		if (c->zerocopy_pending && listLength(c->zerocopy_pending)) {
+			struct linger l = {1, 0};
+
+			setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+		}
+		close(c->fd);
+		c->fd = -1;
+		listDelNode(server.clients, c->node);
+		c->node = NULL;
+		__atomic_sub_fetch(&connected_clients, 1, __ATOMIC_RELAXED);
+	}
+	aeWheelCancel(server.el, &c->idleTimer);
+	if (c->flags & REDIS_PENDING_WRITE) listDelNode(server.clients_pending_write, c->pending_write_node);
+	if (c->flags & REDIS_PENDING_READ) listDelNode(server.clients_pending_read, c->pending_read_node);
+	if (c->flags & REDIS_CLOSE_ASAP) listDelNode(server.clients_to_close, c->close_asap_node);
+	if (c->flags & REDIS_PENDING_RESUME) listDelNode(server.clients_pending_resume, c->pending_resume_node);
+	c->flags &= ~(REDIS_PENDING_WRITE | REDIS_PENDING_READ | REDIS_CLOSE_ASAP | REDIS_PENDING_RESUME);
+	if (c->querybuf == server.querybuf_shared) {
+		sdsclear(c->querybuf);
+	} else if (c->querybuf) {
+		releaseQueryBuffer(c->querybuf);
+	}
+	c->querybuf = NULL;
+	protoParserReset(&c->parser);
+	listEmpty(c->reply);
+	releaseZeroCopySends(c);
+
+	// 其他分片还会回复这个客户端, 结构体等回复到达后再释放
+	if (c->flags & REDIS_SHARD_WAIT) {
+		c->flags |= REDIS_SHARD_FREED;
+		return;
+	}
+	recycleClient(c);
+}
+
+/*
+ * 在命令执行过程中不能直接释放客户端, 先放进 server.clients_to_close,
+ * 由 beforeSleep 释放. 之后不再给它追加回复, 也不再处理它的命令.
+ */
+void freeClientAsync(redisClient *c)
+{
+	if (c->flags & REDIS_CLOSE_ASAP) return;
+	c->flags |= REDIS_CLOSE_ASAP;
+	listAddNodeTail(server.clients_to_close, c);
+	c->close_asap_node = listLast(server.clients_to_close);
+}
+
+void freeClientsInAsyncFreeQueue(void)
+{
+	listNode *ln;
+
+	while ((ln = listFirst(server.clients_to_close)) != NULL) {
+		redisClient *c = listNodeValue(ln);
+
+		c->flags &= ~REDIS_CLOSE_ASAP;
+		c->close_asap_node = NULL;
+		listDelNode(server.clients_to_close, ln);
+		freeClient(c);
+	}
+}
+
+static void clientIdleTimeout(aeEventLoop *el, aeWheelTimer *timer)
+{
+	redisClient *c = timer->clientData;
+
+	AE_NOTUSED(el);
+	redisLog(REDIS_VERBOSE, "Closing idle client");
+	freeClient(c);
+}
+
+/*------------------------------------------------------------------
+ * 回复
+ *-----------------------------------------------------------------*/
+
+/* 标准大小的复制块放回池中 */
+static void freeReplyBlock(void *ptr)
+{
+	replyBlock *b = ptr;
+
+	if (b->obj) {
+		decrRefCount(b->obj);
+	} else if (b->size == REDIS_REPLY_CHUNK_BYTES && poolPut(&server.reply_pool, b)) {
+		return;
+	}
+	zfree(b);
+}
+
+static inline char *replyBlockData(replyBlock *b)
+{
+	return b->obj ? b->obj->ptr : b->buf;
+}
+
+#define replyBlockMemory(b) (sizeof(replyBlock) + (b)->size)
+
+#define clientHasPendingReplies(c) ((c)->bufpos > 0 || listLength((c)->reply) > 0)
+
+/*------------------------------------------------------------------
+ * 零拷贝发送
+ *-----------------------------------------------------------------*/
+
+#define clientHasZeroCopyPending(c) ((c)->zerocopy_pending && listLength((c)->zerocopy_pending) > 0)
+
+static void freeZeroCopySend(void *ptr)
+{
+	zeroCopySend *zs = ptr;
+
+	decrRefCount(zs->obj);
+	zfree(zs);
+}
+
+/* 内核按发送顺序给每次成功的 MSG_ZEROCOPY 发送分配递增的 id, 这里保持同样的编号 */
+static void trackZeroCopySend(redisClient *c, robj *obj)
+{
+	zeroCopySend *zs = zmalloc(sizeof(*zs));
+
+	if (c->zerocopy_pending == NULL) {
+		c->zerocopy_pending = listCreate();
+		listSetFreeMethod(c->zerocopy_pending, freeZeroCopySend);
+	}
+	zs->id = c->zerocopy_next_id++;
+	zs->obj = obj;
+	incrRefCount(obj);
+	listAddNodeTail(c->zerocopy_pending, zs);
+}
+
+static void releaseZeroCopySends(redisClient *c)
+{
+	if (c->zerocopy_pending == NULL) return;
+	listRelease(c->zerocopy_pending);
+	c->zerocopy_pending = NULL;
+}
+
+/* 释放 id 在 [lo, hi] 内的发送, id 是 32 位回绕的 */
+static void completeZeroCopySends(redisClient *c, uint32_t lo, uint32_t hi)
+{
+	listNode *ln, *next;
+
+	for (ln = listFirst(c->zerocopy_pending); ln; ln = next) {
+		zeroCopySend *zs = listNodeValue(ln);
+
+		next = listNextNode(ln);
+		if ((int32_t)(zs->id - hi) > 0) break;
+		if ((uint32_t)(zs->id - lo) <= (uint32_t)(hi - lo)) listDelNode(c->zerocopy_pending, ln);
+	}
+}
+
+/*
+ * 错误队列可读时回收零拷贝发送的完成通知. 内核实际复制了数据时(例如回环连接)
+ * 零拷贝没有收益, 之后这个客户端改用普通发送.
+ */
+static void zeroCopyCompletionHandler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+	redisClient *c = privdata;
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+
+	AE_NOTUSED(el);
+	AE_NOTUSED(mask);
+
+	while (c->zerocopy_pending) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *serr;
+
+			if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+				!(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR)) continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			completeZeroCopySends(c, serr->ee_info, serr->ee_data);
+			if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && (c->flags & REDIS_ZEROCOPY)) {
+				c->flags &= ~REDIS_ZEROCOPY;
+				redisLog(REDIS_VERBOSE, "Zero-copy send fell back to copying, disabled for client fd=%d", fd);
+			}
+		}
+	}
+	if ((c->flags & REDIS_CLOSE_AFTER_REPLY) && !clientHasPendingReplies(c) && !clientHasZeroCopyPending(c)) {
+		freeClient(c);
+	}
+#else
+	AE_NOTUSED(el);
+	AE_NOTUSED(fd);
+	AE_NOTUSED(privdata);
+	AE_NOTUSED(mask);
+#endif
+}
+
+/* 在新的 TCP 连接上开启零拷贝发送, 不支持时只记录一次日志, 之后都用普通发送 */
+static void enableClientZeroCopy(redisClient *c)
+{
+	static int unsupported = 0;
+
+	if (__atomic_load_n(&unsupported, __ATOMIC_RELAXED)) return;
+	if (anetEnableZeroCopy(server.neterr, c->fd) == ANET_ERR) {
+		if (!__atomic_exchange_n(&unsupported, 1, __ATOMIC_RELAXED)) {
+			redisLog(REDIS_WARNING, "Zero-copy send unavailable, falling back to copying: %s", server.neterr);
+		}
+		return;
+	}
+	if (aeCreateFileEvent(server.el, c->fd, AE_ERRQUEUE, zeroCopyCompletionHandler, c) == AE_ERR) return;
+	c->zerocopy_threshold = server.zerocopy_threshold;
+	c->flags |= REDIS_ZEROCOPY;
+}
+
+/*
+ * 客户端第一次有回复时放进 server.clients_pending_write, 由 beforeSleep 直接写出.
+ * 已有待发送的回复时说明客户端已在列表中或已注册了可写事件.
+ */
+static int prepareClientToWrite(redisClient *c)
+{
+	// 伪客户端只把回复留在缓冲区中
+	if (c->fd == -1) return REDIS_OK;
+	if (c->flags & (REDIS_CLOSE_AFTER_REPLY | REDIS_CLOSE_ASAP)) return REDIS_ERR;
+	if (!(c->flags & REDIS_PENDING_WRITE) && !clientHasPendingReplies(c)) {
+		c->flags |= REDIS_PENDING_WRITE;
+		listAddNodeTail(server.clients_pending_write, c);
+		c->pending_write_node = listLast(server.clients_pending_write);
+	}
+	return REDIS_OK;
+}
+
+/*------------------------------------------------------------------
+ * 输出缓冲区限制
+ *
+ * 每类客户端有硬限制和软限制: 超过硬限制立即断开, 连续超过软限制
+ * soft_limit_seconds 秒才断开. 按回复块实际占用的内存计算, 大对象的引用
+ * 也计入, 因为回复写出前对象的内存不会释放. 只在新增回复块时检查.
+ *-----------------------------------------------------------------*/
+
+clientBufferLimitsConfig clientBufferLimitsDefaults[REDIS_CLIENT_TYPE_COUNT] = {
+	{0, 0, 0},
+	{1024*1024*256, 1024*1024*64, 60},
+	{1024*1024*32, 1024*1024*8, 60}
+};
+
+int getClientType(redisClient *c)
+{
+	if (c->flags & REDIS_SLAVE) return REDIS_CLIENT_TYPE_SLAVE;
+	if (c->flags & REDIS_PUBSUB) return REDIS_CLIENT_TYPE_PUBSUB;
+	return REDIS_CLIENT_TYPE_NORMAL;
+}
+
+int getClientTypeByName(char *name)
+{
+	if (!strcasecmp(name, "normal")) return REDIS_CLIENT_TYPE_NORMAL;
+	else if (!strcasecmp(name, "slave") || !strcasecmp(name, "replica")) return REDIS_CLIENT_TYPE_SLAVE;
+	else if (!strcasecmp(name, "pubsub")) return REDIS_CLIENT_TYPE_PUBSUB;
+	return -1;
+}
+
+char *getClientTypeName(int class)
+{
+	switch (class) {
+	case REDIS_CLIENT_TYPE_NORMAL: return "normal";
+	case REDIS_CLIENT_TYPE_SLAVE: return "slave";
+	case REDIS_CLIENT_TYPE_PUBSUB: return "pubsub";
+	default: return NULL;
+	}
+}
+
+/* 回复占用的内存, 内联的 buf 是客户端结构体的一部分, 不计入 */
+unsigned long long getClientOutputBufferMemoryUsage(redisClient *c)
+{
+	return c->reply_memory + listLength(c->reply) * sizeof(listNode);
+}
+
+/* 超过硬限制, 或者持续超过软限制的时间超过 soft_limit_seconds 时返回 1 */
+int checkClientOutputBufferLimits(redisClient *c)
+{
+	clientBufferLimitsConfig *limit = &server.client_obuf_limits[getClientType(c)];
+	unsigned long long used = getClientOutputBufferMemoryUsage(c);
+	int soft = 0, hard = 0;
+
+	if (limit->hard_limit_bytes && used >= limit->hard_limit_bytes) hard = 1;
+	if (limit->soft_limit_bytes && used >= limit->soft_limit_bytes) soft = 1;
+
+	if (soft) {
+		if (c->obuf_soft_limit_reached_time == 0) {
+			c->obuf_soft_limit_reached_time = server.unixtime;
+			soft = 0;
+		} else if (server.unixtime - c->obuf_soft_limit_reached_time <= limit->soft_limit_seconds) {
+			soft = 0;
+		}
+	} else {
+		c->obuf_soft_limit_reached_time = 0;
+	}
+	return soft || hard;
+}
+
+/*
+ * 超过限制时异步关闭客户端, 不再给它追加回复. 开启 client-output-buffer-pause-reads 时,
+ * 超过软限制先暂停读取这个客户端, 不再执行它的命令, 回复写到软限制以下再恢复.
+ */
+static void closeClientOnOutputBufferLimitReached(redisClient *c)
+{
+	clientBufferLimitsConfig *limit;
+
+	if (c->fd == -1 || (c->flags & REDIS_CLOSE_ASAP)) return;
+	if (checkClientOutputBufferLimits(c)) {
+		redisLog(REDIS_WARNING, "Client id=%llu (%s) scheduled to be closed ASAP for overcoming of output buffer limits (%llu bytes)",
+			(unsigned long long)c->id, getClientTypeName(getClientType(c)), getClientOutputBufferMemoryUsage(c));
+		freeClientAsync(c);
+		return;
+	}
+
+	limit = &server.client_obuf_limits[getClientType(c)];
+	if (server.client_obuf_pause_reads && !(c->flags & REDIS_READ_PAUSED) &&
+		limit->soft_limit_bytes && getClientOutputBufferMemoryUsage(c) >= limit->soft_limit_bytes) {
+		c->flags |= REDIS_READ_PAUSED;
+		aeDeleteFileEvent(server.el, c->fd, AE_READABLE);
+	}
+}
+
+/*
+ * 输出缓冲区降到软限制以下时恢复读取. 在写的过程中调用, 不能在这里执行命令,
+ * 暂停期间已经读到的命令放进 server.clients_pending_resume, 由 beforeSleep 执行.
+ */
+static void resumeClientReadsIfNeeded(redisClient *c)
+{
+	clientBufferLimitsConfig *limit = &server.client_obuf_limits[getClientType(c)];
+
+	if (!(c->flags & REDIS_READ_PAUSED)) return;
+	if (getClientOutputBufferMemoryUsage(c) >= limit->soft_limit_bytes) return;
+	c->flags &= ~REDIS_READ_PAUSED;
+	if (aeCreateFileEvent(server.el, c->fd, AE_READABLE, readQueryFromClient, c) == AE_ERR) {
+		freeClientAsync(c);
+		return;
+	}
+	if (c->flags & REDIS_PENDING_RESUME) return;
+	c->flags |= REDIS_PENDING_RESUME;
+	listAddNodeTail(server.clients_pending_resume, c);
+	c->pending_resume_node = listLast(server.clients_pending_resume);
+}
+
+/* 执行恢复读取的客户端在暂停期间积压的命令, 返回处理的客户端数 */
+int handleClientsWithPendingResumes(void)
+{
+	listNode *ln;
+	int processed = 0;
+
+	while ((ln = listFirst(server.clients_pending_resume)) != NULL) {
+		redisClient *c = listNodeValue(ln);
+
+		c->flags &= ~REDIS_PENDING_RESUME;
+		c->pending_resume_node = NULL;
+		listDelNode(server.clients_pending_resume, ln);
+		processInputBuffer(c);
+		processed++;
+	}
+	return processed;
+}
+
+/* 追加到最后一个复制块, 放不下的部分放进新块 */
+static void _addReplyToList(redisClient *c, const char *s, size_t len)
+{
+	listNode *ln = listLast(c->reply);
+	replyBlock *tail = ln ? listNodeValue(ln) : NULL;
+
+	if (tail && tail->obj == NULL) {
+		size_t copy = tail->size - tail->used;
+
+		if (copy > len) copy = len;
+		memcpy(tail->buf + tail->used, s, copy);
+		tail->used += copy;
+		c->reply_bytes += copy;
+		s += copy;
+		len -= copy;
+	}
+	if (len) {
+		size_t size = len < REDIS_REPLY_CHUNK_BYTES ? REDIS_REPLY_CHUNK_BYTES : len;
+
+		if (size != REDIS_REPLY_CHUNK_BYTES || (tail = poolGet(&server.reply_pool)) == NULL) {
+			tail = zmalloc(sizeof(*tail) + size);
+		}
+		tail->obj = NULL;
+		tail->size = size;
+		tail->used = len;
+		memcpy(tail->buf, s, len);
+		listAddNodeTail(c->reply, tail);
+		c->reply_bytes += len;
+		c->reply_memory += replyBlockMemory(tail);
+		closeClientOnOutputBufferLimitReached(c);
+	}
+}
+
+void addReplyString(redisClient *c, const char *s, size_t len)
+{
+	if (prepareClientToWrite(c) != REDIS_OK) return;
+
+	// 链表非空时只能追加到链表, 保证回复的顺序
+	if (listLength(c->reply) == 0) {
+		size_t copy = sizeof(c->buf) - c->bufpos;
+
+		if (copy > len) copy = len;
+		memcpy(c->buf + c->bufpos, s, copy);
+		c->bufpos += copy;
+		s += copy;
+		len -= copy;
+	}
+	if (len) _addReplyToList(c, s, len);
+}
+
+/*
+ * 小对象复制到输出缓冲区, 大对象只增加引用计数挂到回复链表上,
+ * 发送时 iovec 直接指向对象的内容. 之后键被覆盖或删除也不影响还没发送的回复.
+ */
+void addReply(redisClient *c, robj *obj)
+{
+	size_t len = stringObjectLen(obj);
+	replyBlock *b;
+
+	if (len < REDIS_REPLY_REF_MIN_BYTES) {
+		addReplyString(c, obj->ptr, len);
+		return;
+	}
+	if (prepareClientToWrite(c) != REDIS_OK) return;
+	b = zmalloc(sizeof(*b));
+	b->obj = obj;
+	incrRefCount(obj);
+	b->size = b->used = len;
+	listAddNodeTail(c->reply, b);
+	c->reply_bytes += len;
+	c->reply_memory += replyBlockMemory(b);
+	closeClientOnOutputBufferLimitReached(c);
+}
+
+/* 取走伪客户端缓冲区中的全部回复, 复制成一个 sds */
+sds takeClientReply(redisClient *c)
+{
+	sds reply = sdsnewlen(c->buf, c->bufpos);
+	listNode *ln;
+
+	while ((ln = listFirst(c->reply)) != NULL) {
+		replyBlock *b = listNodeValue(ln);
+
+		reply = sdscatlen(reply, replyBlockData(b), b->used);
+		listDelNode(c->reply, ln);
+	}
+	c->bufpos = 0;
+	c->reply_bytes = 0;
+	c->reply_memory = 0;
+	return reply;
+}
+
+static void addReplyLongLongWithPrefix(redisClient *c, long long ll, char prefix)
+{
+	char buf[128];
+	int len;
+
+	buf[0] = prefix;
+	len = ll2string(buf + 1, sizeof(buf) - 1, ll);
+	buf[len + 1] = '\r';
+	buf[len + 2] = '\n';
+	addReplyString(c, buf, len + 3);
+}
+
+void addReplyLongLong(redisClient *c, long long ll)
+{
+	if (ll == 0) {
+		addReply(c, shared.czero);
+	} else if (ll == 1) {
+		addReply(c, shared.cone);
+	} else {
+		addReplyLongLongWithPrefix(c, ll, ':');
+	}
+}
+
+void addReplyMultiBulkLen(redisClient *c, long length)
+{
+	addReplyLongLongWithPrefix(c, length, '*');
+}
+
+void addReplyBulk(redisClient *c, robj *obj)
+{
+	addReplyLongLongWithPrefix(c, stringObjectLen(obj), '$');
+	addReply(c, obj);
+	addReply(c, shared.crlf);
+}
+
+void addReplyBulkCBuffer(redisClient *c, const void *p, size_t len)
+{
+	addReplyLongLongWithPrefix(c, len, '$');
+	addReplyString(c, p, len);
+	addReply(c, shared.crlf);
+}
+
+void addReplyError(redisClient *c, const char *err)
+{
+	addReplyString(c, "-ERR ", 5);
+	addReplyString(c, err, strlen(err));
+	addReplyString(c, "\r\n", 2);
+}
+
+void addReplyErrorFormat(redisClient *c, const char *fmt, ...)
+{
+	va_list ap;
+	sds s;
+
+	va_start(ap, fmt);
+	s = sdscatvprintf(sdsempty(), fmt, ap);
+	va_end(ap);
+	// 错误信息里不能有换行, 否则会破坏协议
+	s = sdsmapchars(s, "\r\n", "  ", 2);
+	addReplyError(c, s);
+	sdsfree(s);
+}
+
+void addReplyStatus(redisClient *c, const char *status)
+{
+	addReplyString(c, "+", 1);
+	addReplyString(c, status, strlen(status));
+	addReplyString(c, "\r\n", 2);
+}
+
+static ssize_t sendReplyIov(int fd, struct iovec *iov, int iovcnt, int flags)
+{
+#ifdef HAVE_MSG_NOSIGNAL
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	return sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+#else
+	((void) flags);
+	return writev(fd, iov, iovcnt);
+#endif
+}
+
+#define replyBlockZeroCopy(c, b) \
+	(((c)->flags & REDIS_ZEROCOPY) && (b)->obj && (b)->used >= (c)->zerocopy_threshold)
+
+/*
+ * 用 MSG_ZEROCOPY 发送一个引用大对象的块, 内核直接引用对象所在的内存,
+ * 单次可以写出 REDIS_ZEROCOPY_MAX_WRITE 字节. 内核的零拷贝额度用完(ENOBUFS)时
+ * 退回普通发送. 发送成功时在 io_zerocopy_obj 中记下对象, 引用计数由主线程处理.
+ */
+static ssize_t writeZeroCopyBlock(redisClient *c, replyBlock *b, size_t offset)
+{
+	struct iovec iov;
+	ssize_t nwritten = -1;
+
+	iov.iov_base = replyBlockData(b) + offset;
+	iov.iov_len = b->used - offset;
+#ifdef HAVE_MSG_ZEROCOPY
+	if (iov.iov_len > REDIS_ZEROCOPY_MAX_WRITE) iov.iov_len = REDIS_ZEROCOPY_MAX_WRITE;
+	nwritten = sendReplyIov(c->fd, &iov, 1, MSG_ZEROCOPY);
+	if (nwritten > 0) {
+		c->io_zerocopy_obj = b->obj;
+		return nwritten;
+	}
+	if (nwritten == -1 && errno != ENOBUFS) return nwritten;
+#endif
+	if (iov.iov_len > REDIS_MAX_WRITE_PER_EVENT) iov.iov_len = REDIS_MAX_WRITE_PER_EVENT;
+	return sendReplyIov(c->fd, &iov, 1, 0);
+}
+
+/*
+ * 把 buf 和回复链表拼成 iovec, 用一次 sendmsg 写出, 流水线命令的多个回复
+ * 只需要一次系统调用. 每次最多写 REDIS_MAX_WRITE_PER_EVENT 字节.
+ * 遇到可以零拷贝发送的块时在它之前截断, 前面的部分全部写出后再单独发送这一块.
+ */
+static ssize_t writeReplyVector(redisClient *c)
+{
+	struct iovec iov[REDIS_REPLY_IOV_MAX];
+	size_t total = 0, offset = c->sentlen;
+	int iovcnt = 0;
+	listNode *ln;
+	replyBlock *zb = NULL;
+	ssize_t nwritten = 0, zwritten;
+
+	c->io_zerocopy_obj = NULL;
+	if (c->bufpos > 0) {
+		iov[0].iov_base = c->buf + c->sentlen;
+		iov[0].iov_len = c->bufpos - c->sentlen;
+		total = iov[0].iov_len;
+		iovcnt = 1;
+		offset = 0;
+	}
+	for (ln = listFirst(c->reply); ln && iovcnt < REDIS_REPLY_IOV_MAX && total < REDIS_MAX_WRITE_PER_EVENT;
+		ln = listNextNode(ln)) {
+		replyBlock *b = listNodeValue(ln);
+		size_t len = b->used - offset;
+
+		if (replyBlockZeroCopy(c, b)) {
+			zb = b;
+			break;
+		}
+		if (len > REDIS_MAX_WRITE_PER_EVENT - total) len = REDIS_MAX_WRITE_PER_EVENT - total;
+		iov[iovcnt].iov_base = replyBlockData(b) + offset;
+		iov[iovcnt].iov_len = len;
+		iovcnt++;
+		total += len;
+		offset = 0;
+	}
+
+	if (iovcnt) {
+		nwritten = sendReplyIov(c->fd, iov, iovcnt, 0);
+		if (!zb || nwritten != (ssize_t)total) return nwritten;
+	} else if (!zb) {
+		return 0;
+	}
+	zwritten = writeZeroCopyBlock(c, zb, offset);
+	if (zwritten == -1) return nwritten ? nwritten : -1;
+	return nwritten + zwritten;
+}
+
+/* 丢弃已经写出的 nwritten 个字节, 写完的块随之释放 */
+static void consumeReply(redisClient *c, size_t nwritten)
+{
+	if (c->bufpos > 0) {
+		size_t left = c->bufpos - c->sentlen;
+
+		if (nwritten < left) {
+			c->sentlen += nwritten;
+			return;
+		}
+		nwritten -= left;
+		c->bufpos = 0;
+		c->sentlen = 0;
+	}
+	while (nwritten) {
+		listNode *ln = listFirst(c->reply);
+		replyBlock *b = listNodeValue(ln);
+		size_t left = b->used - c->sentlen;
+
+		if (nwritten < left) {
+			c->sentlen += nwritten;
+			return;
+		}
+		nwritten -= left;
+		c->reply_bytes -= b->used;
+		c->reply_memory -= replyBlockMemory(b);
+		c->sentlen = 0;
+		listDelNode(c->reply, ln);
+	}
+}
+
+/*
+ * 处理一次写的结果(nwritten 和出错时的 err), 全部写完时删除可写事件.
+ * 写操作可能在 I/O 线程中完成, 这里总在主线程中执行. 客户端被释放时返回 REDIS_ERR.
+ */
+static int afterClientWrite(redisClient *c, ssize_t nwritten, int err, int handler_installed)
+{
+	if (nwritten == -1) {
+		if (err == EAGAIN || err == EINTR) return REDIS_OK;
+		redisLog(REDIS_VERBOSE, "Error writing to client: %s", strerror(err));
+		freeClient(c);
+		return REDIS_ERR;
+	}
+	if (nwritten > 0) {
+		if (c->io_zerocopy_obj) {
+			trackZeroCopySend(c, c->io_zerocopy_obj);
+			c->io_zerocopy_obj = NULL;
+		}
+		consumeReply(c, nwritten);
+		c->lastinteraction = server.unixtime;
+		if (server.maxidletime) aeWheelArm(server.el, &c->idleTimer, (long long)server.maxidletime * 1000);
+		resumeClientReadsIfNeeded(c);
+	}
+	if (!clientHasPendingReplies(c)) {
+		if (handler_installed) aeDeleteFileEvent(server.el, c->fd, AE_WRITABLE);
+		// 零拷贝发送完成前内核还在引用对象的内存, 等完成通知到齐再关闭
+		if ((c->flags & REDIS_CLOSE_AFTER_REPLY) && !clientHasZeroCopyPending(c)) {
+			freeClient(c);
+			return REDIS_ERR;
+		}
+	}
+	return REDIS_OK;
+}
+
+/* 用一次 sendmsg 写出客户端的回复, 客户端被释放时返回 REDIS_ERR */
+static int writeToClient(redisClient *c, int handler_installed)
+{
+	ssize_t nwritten = writeReplyVector(c);
+
+	return afterClientWrite(c, nwritten, errno, handler_installed);
+}
+
+void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	AE_NOTUSED(el);
+	AE_NOTUSED(fd);
+	AE_NOTUSED(mask);
+
+	writeToClient(privdata, 1);
+}
+
+/*
+ * 在 beforeSleep 中调用: 直接写出本轮产生的回复, 大多数请求不需要注册可写事件,
+ * 省掉两次 epoll_ctl 和一轮 epoll_wait. 只有套接字缓冲区写满(或超过单次写出上限)
+ * 还有剩余时才注册可写事件. 返回处理的客户端数量.
+ */
+int handleClientsWithPendingWrites(void)
+{
+	int processed = 0;
+	listNode *ln;
+
+	while ((ln = listFirst(server.clients_pending_write)) != NULL) {
+		redisClient *c = listNodeValue(ln);
+
+		c->flags &= ~REDIS_PENDING_WRITE;
+		c->pending_write_node = NULL;
+		listDelNode(server.clients_pending_write, ln);
+		processed++;
+
+		if (writeToClient(c, 0) == REDIS_ERR) continue;
+		if (clientHasPendingReplies(c) &&
+			aeCreateFileEvent(server.el, c->fd, AE_WRITABLE, sendReplyToClient, c) == AE_ERR) {
+			freeClient(c);
+		}
+	}
+	return processed;
+}
+
+/*------------------------------------------------------------------
+ * 接受连接
+ *-----------------------------------------------------------------*/
+
+/*
+ * 连接数检查放在分配任何客户端资源之前, 连接风暴时被拒绝的连接
+ * 只需要一次 write 和 close.
+ */
+static void acceptCommonHandler(int fd, int flags)
+{
+	redisClient *c;
+
+	if (__atomic_load_n(&connected_clients, __ATOMIC_RELAXED) >= (long)server.maxclients ||
+		fd >= aeGetSetSize(server.el)) {
+		char *err = "-ERR max number of clients reached\r\n";
+
+		if (write(fd, err, strlen(err)) == -1) {
+			// 尽力而为, 写失败也不处理
+		}
+		server.stat_rejected_conn++;
+		close(fd);
+		return;
+	}
+
+#ifndef __linux__
+	// Linux 上这两个选项从监听套接字继承, 见 listenToPort
+	if (!(flags & REDIS_UNIX_SOCKET)) {
+		anetEnableTcpNoDelay(NULL, fd);
+		if (server.tcpkeepalive) anetKeepAlive(NULL, fd, server.tcpkeepalive);
+	}
+#endif
+
+	if ((c = createClient(fd, flags)) == NULL) {
+		redisLog(REDIS_WARNING, "Error registering fd event for the new client: %s (fd=%d)",
+			strerror(errno), fd);
+		return;
+	}
+	if (server.zerocopy_threshold && !(flags & REDIS_UNIX_SOCKET)) enableClientZeroCopy(c);
+	server.stat_numconnections++;
+}
+
+void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	int cport, cfd, max = REDIS_MAX_ACCEPTS_PER_CALL;
+	char cip[REDIS_IP_STR_LEN];
+
+	AE_NOTUSED(el);
+	AE_NOTUSED(mask);
+	AE_NOTUSED(privdata);
+
+	while (max--) {
+		cfd = anetTcpAccept(server.neterr, fd, cip, sizeof(cip), &cport);
+		if (cfd == ANET_ERR) {
+			if (errno != EWOULDBLOCK && errno != EAGAIN) {
+				redisLog(REDIS_WARNING, "Accepting client connection: %s", server.neterr);
+			}
+			return;
+		}
+		redisLog(REDIS_VERBOSE, "Accepted %s:%d", cip, cport);
+		acceptCommonHandler(cfd, 0);
+	}
+}
+
+void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	int cfd, max = REDIS_MAX_ACCEPTS_PER_CALL;
+
+	AE_NOTUSED(el);
+	AE_NOTUSED(mask);
+	AE_NOTUSED(privdata);
+
+	while (max--) {
+		cfd = anetUnixAccept(server.neterr, fd);
+		if (cfd == ANET_ERR) {
+			if (errno != EWOULDBLOCK && errno != EAGAIN) {
+				redisLog(REDIS_WARNING, "Accepting client connection: %s", server.neterr);
+			}
+			return;
+		}
+		redisLog(REDIS_VERBOSE, "Accepted connection to %s", server.unixsocket);
+		acceptCommonHandler(cfd, REDIS_UNIX_SOCKET);
+	}
+}
+
+/*
+ * 监听 port 上所有配置的地址, 没有配置 bind 时同时监听 IPv6 和 IPv4 的所有地址.
+ * 在监听套接字上设置 TCP_NODELAY 和 keepalive, Linux 上新连接会继承这些选项,
+ * 每个连接省掉几次 setsockopt.
+ */
+int listenToPort(int port, int *fds, int *count)
+{
+	// 分片模式下每个分片都监听同一个端口, 由内核分配连接
+	int flags = server.shards > 1 ? ANET_REUSEPORT : ANET_NONE;
+	int j;
+
+	if (server.bindaddr_count == 0) server.bindaddr[0] = NULL;
+	for (j = 0; j < server.bindaddr_count || j == 0; j++) {
+		if (server.bindaddr[j] == NULL) {
+			fds[*count] = anetTcp6Server(server.neterr, port, NULL, server.tcp_backlog, flags);
+			if (fds[*count] != ANET_ERR) {
+				anetNonBlock(NULL, fds[*count]);
+				(*count)++;
+			}
+			fds[*count] = anetTcpServer(server.neterr, port, NULL, server.tcp_backlog, flags);
+			if (fds[*count] != ANET_ERR) {
+				anetNonBlock(NULL, fds[*count]);
+				(*count)++;
+			}
+			// 两个都失败才算失败
+			if (*count) break;
+		} else if (strchr(server.bindaddr[j], ':')) {
+			fds[*count] = anetTcp6Server(server.neterr, port, server.bindaddr[j], server.tcp_backlog, flags);
+		} else {
+			fds[*count] = anetTcpServer(server.neterr, port, server.bindaddr[j], server.tcp_backlog, flags);
+		}
+		if (fds[*count] == ANET_ERR) {
+			redisLog(REDIS_WARNING, "Creating Server TCP listening socket %s:%d: %s",
+				server.bindaddr[j] ? server.bindaddr[j] : "*", port, server.neterr);
+			return REDIS_ERR;
+		}
+		anetNonBlock(NULL, fds[*count]);
+		(*count)++;
+	}
+
+#ifdef __linux__
+	for (j = 0; j < *count; j++) {
+		anetEnableTcpNoDelay(NULL, fds[j]);
+		if (server.tcpkeepalive) anetKeepAlive(NULL, fds[j], server.tcpkeepalive);
+	}
+#endif
+	return REDIS_OK;
+}
+
+/*------------------------------------------------------------------
+ * 读取请求
+ *-----------------------------------------------------------------*/
+
+// 客户端处于这些状态时不再执行查询缓冲区中的命令
+#define CLIENT_STOP_PROCESSING (REDIS_CLOSE_AFTER_REPLY | REDIS_CLOSE_ASAP | REDIS_SHARD_WAIT | REDIS_READ_PAUSED)
+
+/* 一批流水线命令, 参数从解析器复制出来, 仍然指向查询缓冲区 */
+typedef struct pipelineBatch {
+	protoArg *args;
+	size_t nargs;
+	size_t argscap;
+	int count;
+	size_t argi[REDIS_PIPELINE_BATCH];
+	int argc[REDIS_PIPELINE_BATCH];
+	// 命令在查询缓冲区中的起始位置, 中途停止时从这里重新解析
+	size_t start[REDIS_PIPELINE_BATCH];
+	// 查到的命令, 不存在时为 NULL, 执行时不再查找
+	struct redisCommand *cmd[REDIS_PIPELINE_BATCH];
+	// 预取时算出的键哈希值; keyhash[j] 是第 j 条命令第一个键在 hashes 中的下标, 没有算时为 -1
+	unsigned int hashes[REDIS_PIPELINE_PREFETCH_KEYS];
+	int keyhash[REDIS_PIPELINE_BATCH];
+} pipelineBatch;
+
+// 命令只在一个线程中执行, 不会重入, 每个线程(分片)一份就够了
+static __thread pipelineBatch pipeline;
+
+static void pipelineAdd(pipelineBatch *b, size_t start, const protoArg *argv, int argc)
+{
+	if (b->nargs + argc > b->argscap) {
+		b->argscap = b->argscap * 2 > b->nargs + argc ? b->argscap * 2 : b->nargs + argc + 64;
+		b->args = zrealloc(b->args, sizeof(protoArg) * b->argscap);
+	}
+	memcpy(b->args + b->nargs, argv, sizeof(protoArg) * argc);
+	b->argi[b->count] = b->nargs;
+	b->argc[b->count] = argc;
+	b->start[b->count] = start;
+	b->cmd[b->count] = argc ? lookupCommand(argv[0].ptr, argv[0].len) : NULL;
+	b->keyhash[b->count] = -1;
+	b->count++;
+	b->nargs += argc;
+}
+
+/*
+ * 计算一批命令中所有键的哈希值, 按桶、节点、键值分三轮预取,
+ * 每一轮访问的内存在上一轮已经开始加载. 第一个键的哈希值留给命令执行时查找用.
+ */
+static void prefetchPipelineKeys(redisClient *c, pipelineBatch *b)
+{
+	dict *d = c->db->dict;
+	int j, k, n = 0, step;
+
+	if (dictSize(d) == 0) return;
+	for (j = 0; j < b->count && n < REDIS_PIPELINE_PREFETCH_KEYS; j++) {
+		protoArg *argv = b->args + b->argi[j];
+		struct redisCommand *cmd = b->cmd[j];
+		int last;
+
+		if (cmd == NULL || cmd->firstkey == 0) continue;
+		// 参数个数不对的命令不会执行, 键的位置也不可信
+		if ((cmd->arity > 0 && cmd->arity != b->argc[j]) || (b->argc[j] < -cmd->arity)) continue;
+		last = cmd->lastkey < 0 ? b->argc[j] + cmd->lastkey : cmd->lastkey;
+		b->keyhash[j] = n;
+		for (k = cmd->firstkey; k <= last && n < REDIS_PIPELINE_PREFETCH_KEYS; k += cmd->keystep) {
+			b->hashes[n] = dbHashKey(c->db, &argv[k]);
+			dictPrefetch(d, b->hashes[n], DICT_PREFETCH_BUCKET);
+			n++;
+		}
+	}
+	for (step = DICT_PREFETCH_ENTRY; step <= DICT_PREFETCH_KEY; step++) {
+		for (j = 0; j < n; j++) dictPrefetch(d, b->hashes[j], step);
+	}
+}
+
+/*
+ * 查询缓冲区中还有后续命令时, 连同已经解析出的当前命令一起解析出一批,
+ * 先预取所有键再依次执行, 多条命令的缓存未命中互相重叠.
+ * 执行中途客户端不能继续处理命令时, 解析器回到下一条命令的起始位置.
+ * 返回最后一次解析的结果.
+ */
+static int processPipelineBatch(redisClient *c)
+{
+	pipelineBatch *b = &pipeline;
+	int retval = PROTO_OK, j;
+
+	b->count = 0;
+	b->nargs = 0;
+	pipelineAdd(b, 0, c->argv, c->argc);
+	while (b->count < REDIS_PIPELINE_BATCH) {
+		size_t start = protoParserConsumed(&c->parser);
+		protoArg *argv;
+		int argc;
+
+		retval = protoParse(&c->parser, c->querybuf, sdslen(c->querybuf), &argv, &argc);
+		if (retval != PROTO_OK) break;
+		pipelineAdd(b, start, argv, argc);
+	}
+	prefetchPipelineKeys(c, b);
+
+	for (j = 0; j < b->count; j++) {
+		if (c->flags & CLIENT_STOP_PROCESSING) {
+			protoParserRewind(&c->parser, b->start[j]);
+			retval = PROTO_AGAIN;
+			break;
+		}
+		c->argv = b->args + b->argi[j];
+		c->argc = b->argc[j];
+		if (b->keyhash[j] != -1) c->keyhash = &b->hashes[b->keyhash[j]];
+		if (c->argc > 0) processCommand(c, b->cmd[j]);
+		c->keyhash = NULL;
+	}
+	return retval;
+}
+
+/*
+ * 解析并执行查询缓冲区中所有完整的命令, 一次 read() 读到的多条流水线命令
+ * 成批解析、预取后依次执行, 最后统一丢弃已经处理的部分.
+ * 协议错误时回复错误并在写完后关闭连接, 此时返回 REDIS_ERR.
+ */
+int processInputBuffer(redisClient *c)
+{
+	size_t consumed;
+	int retval = PROTO_AGAIN;
+
+	if (c->querybuf == NULL) return REDIS_OK;
+	while (!(c->flags & CLIENT_STOP_PROCESSING)) {
+		if (c->flags & REDIS_PENDING_COMMAND) {
+			// I/O 线程已经解析好了第一条命令
+			c->flags &= ~REDIS_PENDING_COMMAND;
+		} else {
+			retval = protoParse(&c->parser, c->querybuf, sdslen(c->querybuf), &c->argv, &c->argc);
+			if (retval != PROTO_OK) break;
+		}
+		if (c->parser.pos < sdslen(c->querybuf)) {
+			retval = processPipelineBatch(c);
+		} else if (c->argc > 0) {
+			processCommand(c, NULL);
+		}
+		c->argv = NULL;
+		c->argc = 0;
+		if (retval == PROTO_ERR) break;
+	}
+
+	if (retval == PROTO_ERR) {
+		redisLog(REDIS_VERBOSE, "%s, closing client", c->parser.err);
+		addReplyError(c, c->parser.err);
+		c->flags |= REDIS_CLOSE_AFTER_REPLY;
+	}
+	if (c->flags & REDIS_CLOSE_AFTER_REPLY) {
+		// 之后收到的数据都不再处理
+		aeDeleteFileEvent(server.el, c->fd, AE_READABLE);
+		sdsclear(c->querybuf);
+		protoParserFree(&c->parser);
+		resetClientQueryBuffer(c);
+		return REDIS_ERR;
+	}
+
+	if ((consumed = protoParserConsumed(&c->parser)) > 0) {
+		sdsrange(c->querybuf, consumed, -1);
+		protoParserShift(&c->parser, consumed);
+	}
+	resetClientQueryBuffer(c);
+	return REDIS_OK;
+}
+
+/*
+ * 从套接字读取数据到查询缓冲区, 读到数据且 parse 不为 0 时顺便解析出第一条命令.
+ * 可能在 I/O 线程中执行, 只能访问客户端自己的状态, 结果记在 io_nread/io_errno 中.
+ */
+static void readClientSocket(redisClient *c, int parse)
+{
+	size_t qblen;
+
+	qblen = sdslen(c->querybuf);
+	c->querybuf = sdsMakeRoomFor(c->querybuf, REDIS_IOBUF_LEN);
+	c->io_nread = read(c->fd, c->querybuf + qblen, REDIS_IOBUF_LEN);
+	c->io_errno = errno;
+	if (c->io_nread <= 0) return;
+	sdsIncrLen(c->querybuf, c->io_nread);
+
+	// 解析出错时解析器状态不变, 主线程重新解析会得到同样的错误
+	if (parse && protoParse(&c->parser, c->querybuf, sdslen(c->querybuf), &c->argv, &c->argc) == PROTO_OK) {
+		c->flags |= REDIS_PENDING_COMMAND;
+	}
+}
+
+/* 在主线程中处理读的结果并执行命令 */
+static void afterClientRead(redisClient *c)
+{
+	if (c->io_nread == -1) {
+		if (c->io_errno == EAGAIN || c->io_errno == EINTR) {
+			resetClientQueryBuffer(c);
+			return;
+		}
+		redisLog(REDIS_VERBOSE, "Reading from client: %s", strerror(c->io_errno));
+		freeClient(c);
+		return;
+	} else if (c->io_nread == 0) {
+		redisLog(REDIS_VERBOSE, "Client closed connection");
+		freeClient(c);
+		return;
+	}
+
+	c->lastinteraction = server.unixtime;
+	if (server.maxidletime) aeWheelArm(server.el, &c->idleTimer, (long long)server.maxidletime * 1000);
+	if (sdslen(c->querybuf) > REDIS_MAX_QUERYBUF_LEN) {
+		redisLog(REDIS_WARNING, "Closing client that reached max query buffer length (%zu bytes)",
+			sdslen(c->querybuf));
+		freeClient(c);
+		return;
+	}
+	processInputBuffer(c);
+}
+
+static int postponeClientRead(redisClient *c);
+
+void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	redisClient *c = (redisClient *)privdata;
+
+	AE_NOTUSED(el);
+	AE_NOTUSED(fd);
+	AE_NOTUSED(mask);
+
+	if (postponeClientRead(c)) return;
+	// 只有事件循环线程读取时才能用共享缓冲区, 缓冲区扩容后记下新的地址
+	if (c->querybuf == NULL) {
+		c->querybuf = server.querybuf_shared;
+		readClientSocket(c, 0);
+		server.querybuf_shared = c->querybuf;
+	} else {
+		readClientSocket(c, 0);
+	}
+	afterClientRead(c);
+}
+
+/*------------------------------------------------------------------
+ * 线程化 I/O
+ *
+ * 命令仍然只在主线程中执行. 每轮事件循环在 beforeSleep 中把等待读写的客户端
+ * 平均分给 I/O 线程(主线程也分一份), 各线程并行完成 read()+解析或 sendmsg(),
+ * 主线程等所有线程做完后再依次执行命令、处理写的结果.
+ *
+ * 交接不用锁: 主线程先填好线程的客户端数组, 再用 release 语义写入线程的待处理数量;
+ * 线程自旋等到数量不为 0 后处理, 处理完把数量清零, 主线程自旋等待全部清零.
+ * 负载低时主线程持有各线程的互斥锁让线程停在锁上, 不再空转.
+ *-----------------------------------------------------------------*/
+
+#define IO_THREADS_OP_READ 0
+#define IO_THREADS_OP_WRITE 1
+// 线程空转这么多次还没有任务就去获取互斥锁, 处于停止状态时会阻塞在锁上
+#define IO_THREADS_SPIN_LOOPS 1000000
+
+typedef struct ioThreadJobs {
+	redisClient **clients;
+	int count;
+	int size;
+} ioThreadJobs;
+
+static pthread_t io_threads[REDIS_IO_THREADS_MAX_NUM];
+static pthread_mutex_t io_threads_mutex[REDIS_IO_THREADS_MAX_NUM];
+static ioThreadJobs io_threads_jobs[REDIS_IO_THREADS_MAX_NUM];
+// 各线程待处理的客户端数量, 主线程写入, 线程处理完后清零
+static unsigned long io_threads_pending[REDIS_IO_THREADS_MAX_NUM];
+static int io_threads_op;
+static int io_threads_active = 0;
+
+static inline unsigned long getIOPendingCount(int id)
+{
+	return __atomic_load_n(&io_threads_pending[id], __ATOMIC_ACQUIRE);
+}
+
+static inline void setIOPendingCount(int id, unsigned long count)
+{
+	__atomic_store_n(&io_threads_pending[id], count, __ATOMIC_RELEASE);
+}
+
+static void ioThreadJobsAdd(ioThreadJobs *jobs, redisClient *c)
+{
+	if (jobs->count == jobs->size) {
+		jobs->size = jobs->size ? jobs->size * 2 : 64;
+		jobs->clients = zrealloc(jobs->clients, sizeof(redisClient *) * jobs->size);
+	}
+	jobs->clients[jobs->count++] = c;
+}
+
+static void ioThreadDoJobs(int id)
+{
+	ioThreadJobs *jobs = &io_threads_jobs[id];
+	int j;
+
+	for (j = 0; j < jobs->count; j++) {
+		redisClient *c = jobs->clients[j];
+
+		if (io_threads_op == IO_THREADS_OP_WRITE) {
+			c->io_nwritten = writeReplyVector(c);
+			c->io_errno = errno;
+		} else {
+			readClientSocket(c, 1);
+		}
+	}
+}
+
+static void *IOThreadMain(void *arg)
+{
+	int id = (int)(long)arg, j;
+
+	while (1) {
+		for (j = 0; j < IO_THREADS_SPIN_LOOPS; j++) {
+			if (getIOPendingCount(id) != 0) break;
+		}
+		if (getIOPendingCount(id) == 0) {
+			pthread_mutex_lock(&io_threads_mutex[id]);
+			pthread_mutex_unlock(&io_threads_mutex[id]);
+			continue;
+		}
+
+		ioThreadDoJobs(id);
+		setIOPendingCount(id, 0);
+	}
+	return NULL;
+}
+
+void initThreadedIO(void)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int j;
+
+	// 线程是自旋等待的, 多于 CPU 核数只会互相抢占
+	if (ncpu > 0 && server.io_threads_num > ncpu) {
+		redisLog(REDIS_WARNING, "io-threads %d exceeds the %ld online CPUs, using %ld",
+			server.io_threads_num, ncpu, ncpu);
+		server.io_threads_num = ncpu;
+	}
+	if (server.io_threads_num == 1) return;
+
+	// 线程中读取会扩展查询缓冲区
+	zmalloc_enable_thread_safeness();
+	for (j = 0; j < server.io_threads_num; j++) {
+		io_threads_jobs[j].clients = NULL;
+		io_threads_jobs[j].count = io_threads_jobs[j].size = 0;
+		io_threads_pending[j] = 0;
+		// 0 号是主线程
+		if (j == 0) continue;
+
+		pthread_mutex_init(&io_threads_mutex[j], NULL);
+		// 开始时处于停止状态
+		pthread_mutex_lock(&io_threads_mutex[j]);
+		if (pthread_create(&io_threads[j], NULL, IOThreadMain, (void *)(long)j) != 0) {
+			redisLog(REDIS_WARNING, "Fatal: Can't initialize IO thread.");
+			exit(1);
+		}
+	}
+	redisLog(REDIS_NOTICE, "Threaded I/O enabled with %d threads", server.io_threads_num);
+}
+
+static void startThreadedIO(void)
+{
+	int j;
+
+	for (j = 1; j < server.io_threads_num; j++) pthread_mutex_unlock(&io_threads_mutex[j]);
+	io_threads_active = 1;
+}
+
+static void stopThreadedIO(void)
+{
+	int j;
+
+	// 停止前先处理完已经推迟的读
+	handleClientsWithPendingReadsUsingThreads();
+	for (j = 1; j < server.io_threads_num; j++) pthread_mutex_lock(&io_threads_mutex[j]);
+	io_threads_active = 0;
+}
+
+/* 待写的客户端太少时停止线程, 由主线程自己完成, 返回 1 表示不使用线程 */
+static int stopThreadedIOIfNeeded(void)
+{
+	unsigned long pending = listLength(server.clients_pending_write);
+
+	if (server.io_threads_num == 1) return 1;
+	if (pending < (unsigned long)server.io_threads_num * 2) {
+		if (io_threads_active) stopThreadedIO();
+		return 1;
+	}
+	return 0;
+}
+
+/* 把任务分给各线程, 主线程处理自己的一份后等待其余线程完成 */
+static void runIOThreads(int op)
+{
+	int j;
+
+	io_threads_op = op;
+	for (j = 1; j < server.io_threads_num; j++) {
+		setIOPendingCount(j, io_threads_jobs[j].count);
+	}
+	ioThreadDoJobs(0);
+	while (1) {
+		unsigned long pending = 0;
+
+		for (j = 1; j < server.io_threads_num; j++) pending += getIOPendingCount(j);
+		if (pending == 0) break;
+	}
+}
+
+/* 线程化 I/O 启用时可读事件只把客户端放进等待列表, 返回 1 表示已推迟 */
+static int postponeClientRead(redisClient *c)
+{
+	if (io_threads_active && server.io_threads_do_reads &&
+		!(c->flags & (REDIS_PENDING_READ | REDIS_CLOSE_AFTER_REPLY))) {
+		// I/O 线程读到的数据要留到主线程执行命令, 不能用共享缓冲区
+		if (c->querybuf == NULL) c->querybuf = allocQueryBuffer();
+		c->flags |= REDIS_PENDING_READ;
+		listAddNodeTail(server.clients_pending_read, c);
+		c->pending_read_node = listLast(server.clients_pending_read);
+		return 1;
+	}
+	return 0;
+}
+
+int handleClientsWithPendingReadsUsingThreads(void)
+{
+	int processed = 0, j;
+	listNode *ln;
+	listIter li;
+
+	if (!io_threads_active || !server.io_threads_do_reads) return 0;
+	if (listLength(server.clients_pending_read) == 0) return 0;
+
+	for (j = 0; j < server.io_threads_num; j++) io_threads_jobs[j].count = 0;
+	listRewind(server.clients_pending_read, &li);
+	while ((ln = listNext(&li)) != NULL) {
+		ioThreadJobsAdd(&io_threads_jobs[processed % server.io_threads_num], listNodeValue(ln));
+		processed++;
+	}
+	runIOThreads(IO_THREADS_OP_READ);
+
+	// 按到达顺序执行命令
+	while ((ln = listFirst(server.clients_pending_read)) != NULL) {
+		redisClient *c = listNodeValue(ln);
+
+		c->flags &= ~REDIS_PENDING_READ;
+		c->pending_read_node = NULL;
+		listDelNode(server.clients_pending_read, ln);
+		afterClientRead(c);
+	}
+	return processed;
+}
+
+int handleClientsWithPendingWritesUsingThreads(void)
+{
+	int processed = 0, j, k;
+	listNode *ln;
+
+	if (listLength(server.clients_pending_write) == 0) return 0;
+	if (stopThreadedIOIfNeeded()) return handleClientsWithPendingWrites();
+	if (!io_threads_active) startThreadedIO();
+
+	for (j = 0; j < server.io_threads_num; j++) io_threads_jobs[j].count = 0;
+	while ((ln = listFirst(server.clients_pending_write)) != NULL) {
+		redisClient *c = listNodeValue(ln);
+
+		c->flags &= ~REDIS_PENDING_WRITE;
+		c->pending_write_node = NULL;
+		listDelNode(server.clients_pending_write, ln);
+		ioThreadJobsAdd(&io_threads_jobs[processed % server.io_threads_num], c);
+		processed++;
+	}
+	runIOThreads(IO_THREADS_OP_WRITE);
+
+	for (j = 0; j < server.io_threads_num; j++) {
+		for (k = 0; k < io_threads_jobs[j].count; k++) {
+			redisClient *c = io_threads_jobs[j].clients[k];
+
+			if (afterClientWrite(c, c->io_nwritten, c->io_errno, 0) == REDIS_ERR) continue;
+			if (clientHasPendingReplies(c) &&
+				aeCreateFileEvent(server.el, c->fd, AE_WRITABLE, sendReplyToClient, c) == AE_ERR) {
+				freeClient(c);
+			}
+		}
+	}
+	return processed;
+}
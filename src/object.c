@@ -0,0 +1,47 @@
+#include "redis.h"
+
+robj *createObject(int type, void *ptr)
+{
+	robj *o = zmalloc(sizeof(*o));
+
+	o->type = type;
+	o->refcount = 1;
+	o->ptr = ptr;
+	return o;
+}
+
+robj *createStringObject(const char *ptr, size_t len)
+{
+	return createObject(REDIS_STRING, sdsnewlen(ptr, len));
+}
+
+void incrRefCount(robj *o)
+{
+	o->refcount++;
+}
+
+void decrRefCount(robj *o)
+{
+	if (o->refcount <= 0) redisPanic("decrRefCount against refcount <= 0");
+	if (o->refcount == 1) {
+		switch (o->type) {
+		case REDIS_STRING: sdsfree(o->ptr); break;
+		default: redisPanic("Unknown object type"); break;
+		}
+		zfree(o);
+	} else {
+		o->refcount--;
+	}
+}
+
+/* 用作 dict/list 的析构函数 */
+void decrRefCountVoid(void *o)
+{
+	decrRefCount(o);
+}
+
+size_t stringObjectLen(robj *o)
+{
+	redisAssert(o->type == REDIS_STRING);
+	return sdslen(o->ptr);
+}
@@ -0,0 +1,82 @@
+#include <stdlib.h>
+
+#include "pool.h"
+#include "zmalloc.h"
+
+#define poolNext(ptr) (*(void **)(ptr))
+
+void poolInit(pool *p, unsigned long cap, void (*destroy)(void *ptr))
+{
+	p->free = NULL;
+	p->nfree = 0;
+	p->cap = cap;
+	p->minfree = 0;
+	p->destroy = destroy;
+	p->hits = 0;
+	p->misses = 0;
+}
+
+static void poolDestroy(pool *p, void *ptr)
+{
+	if (p->destroy) {
+		p->destroy(ptr);
+	} else {
+		zfree(ptr);
+	}
+}
+
+/* 取出一个空闲对象, 池为空时返回 NULL, 由调用方自己分配 */
+void *poolGet(pool *p)
+{
+	void *ptr = p->free;
+
+	if (ptr == NULL) {
+		p->misses++;
+		return NULL;
+	}
+	p->free = poolNext(ptr);
+	p->nfree--;
+	if (p->nfree < p->minfree) p->minfree = p->nfree;
+	p->hits++;
+	return ptr;
+}
+
+/* 放回一个对象, 池已满时返回 0, 由调用方自己释放 */
+int poolPut(pool *p, void *ptr)
+{
+	if (p->nfree >= p->cap) return 0;
+	poolNext(ptr) = p->free;
+	p->free = ptr;
+	p->nfree++;
+	return 1;
+}
+
+/*
+ * 定期调用: 释放上次收缩以来一直空闲的对象中的一半.
+ * 连接数回落后池会逐渐缩小, 而持续的连接抖动仍然能命中池.
+ */
+void poolTrim(pool *p)
+{
+	unsigned long n = (p->minfree + 1) / 2;
+
+	while (n-- && p->free) {
+		void *ptr = p->free;
+
+		p->free = poolNext(ptr);
+		p->nfree--;
+		poolDestroy(p, ptr);
+	}
+	p->minfree = p->nfree;
+}
+
+void poolEmpty(pool *p)
+{
+	while (p->free) {
+		void *ptr = p->free;
+
+		p->free = poolNext(ptr);
+		poolDestroy(p, ptr);
+	}
+	p->nfree = 0;
+	p->minfree = 0;
+}
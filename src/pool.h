@@ -0,0 +1,29 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+/*
+ * 固定大小对象的空闲池. 对象释放时放进空闲链表, 下次分配直接复用,
+ * 连接频繁建立和关闭时不需要反复调用 zmalloc/zfree.
+ * 空闲链表借用对象的前 sizeof(void *) 个字节, 池不是线程安全的, 每个线程各用一个.
+ */
+typedef struct pool {
+	// 空闲对象链表
+	void *free;
+	unsigned long nfree;
+	// 最多保留的空闲对象数量
+	unsigned long cap;
+	// 上次收缩以来空闲对象数量的最小值, 这些对象在这段时间里一直没有用到
+	unsigned long minfree;
+	// 释放空闲对象的方法, 为 NULL 时用 zfree
+	void (*destroy)(void *ptr);
+	unsigned long long hits;
+	unsigned long long misses;
+} pool;
+
+void poolInit(pool *p, unsigned long cap, void (*destroy)(void *ptr));
+void *poolGet(pool *p);
+int poolPut(pool *p, void *ptr);
+void poolTrim(pool *p);
+void poolEmpty(pool *p);
+
+#endif /* __POOL_H__ */
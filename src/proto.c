@@ -0,0 +1,425 @@
+#include <string.h>
+
+#include "proto.h"
+#include "zmalloc.h"
+
+/*
+ * RESP 请求解析
+ *
+ * multibulk: *<argc>\r\n$<len>\r\n<arg>\r\n ...
+ * inline:    按空白分隔的一行, 以 \n 或 \r\n 结尾
+ *
+ * 头部用 memchr 查找分隔符(glibc 中为 SIMD 实现), bulk 内容按长度直接跳过,
+ * 参数以 (指针, 长度) 的形式指向调用方的缓冲区, 不复制.
+ */
+
+void protoParserInit(protoParser *p)
+{
+	p->offs = NULL;
+	p->lens = NULL;
+	p->argv = NULL;
+	p->argvcap = 0;
+	protoParserReset(p);
+}
+
+/* 回到初始状态, 保留已经分配的参数数组 */
+void protoParserReset(protoParser *p)
+{
+	p->reqtype = PROTO_REQ_NONE;
+	p->multibulklen = 0;
+	p->bulklen = -1;
+	p->pos = 0;
+	p->start = 0;
+	p->argc = 0;
+	p->err = NULL;
+}
+
+void protoParserFree(protoParser *p)
+{
+	zfree(p->offs);
+	zfree(p->lens);
+	zfree(p->argv);
+	protoParserInit(p);
+}
+
+static void protoAddArg(protoParser *p, size_t off, size_t len)
+{
+	if (p->argc == p->argvcap) {
+		p->argvcap = p->argvcap ? p->argvcap * 2 : 8;
+		p->offs = zrealloc(p->offs, sizeof(size_t) * p->argvcap);
+		p->lens = zrealloc(p->lens, sizeof(size_t) * p->argvcap);
+		p->argv = zrealloc(p->argv, sizeof(protoArg) * p->argvcap);
+	}
+	p->offs[p->argc] = off;
+	p->lens[p->argc] = len;
+	p->argc++;
+}
+
+// 解析 [s, e) 之间的十进制整数, 最多 18 位
+static int protoParseLen(const char *s, const char *e, long long *value)
+{
+	long long v = 0;
+	int negative = 0;
+
+	if (s < e && *s == '-') {
+		negative = 1;
+		s++;
+	}
+	if (s == e || e - s > 18) return 0;
+	while (s < e) {
+		if (*s < '0' || *s > '9') return 0;
+		v = v * 10 + (*s - '0');
+		s++;
+	}
+	*value = negative ? -v : v;
+	return 1;
+}
+
+static int protoParseInline(protoParser *p, const char *buf, size_t len)
+{
+	const char *newline, *s, *end;
+
+	newline = memchr(buf + p->pos, '\n', len - p->pos);
+	if (newline == NULL) {
+		if (len - p->start > PROTO_INLINE_MAX_SIZE) {
+			p->err = "Protocol error: too big inline request";
+			return PROTO_ERR;
+		}
+		// 已扫描过的部分下次不再扫描
+		p->pos = len;
+		return PROTO_AGAIN;
+	}
+
+	end = newline;
+	if (end > buf + p->start && end[-1] == '\r') end--;
+	s = buf + p->start;
+	while (s < end) {
+		const char *arg;
+
+		while (s < end && (*s == ' ' || *s == '\t')) s++;
+		if (s == end) break;
+		arg = s;
+		while (s < end && *s != ' ' && *s != '\t') s++;
+		protoAddArg(p, arg - buf, s - arg);
+	}
+	p->pos = newline - buf + 1;
+	return PROTO_OK;
+}
+
+static int protoParseMultibulk(protoParser *p, const char *buf, size_t len)
+{
+	const char *newline;
+	long long ll;
+
+	if (p->multibulklen == 0) {
+		newline = memchr(buf + p->pos, '\r', len - p->pos);
+		if (newline == NULL) {
+			if (len - p->pos > PROTO_INLINE_MAX_SIZE) {
+				p->err = "Protocol error: too big mbulk count string";
+				return PROTO_ERR;
+			}
+			return PROTO_AGAIN;
+		}
+		// \r 之后的 \n 还没有读到
+		if (newline + 1 >= buf + len) return PROTO_AGAIN;
+
+		if (!protoParseLen(buf + p->pos + 1, newline, &ll) || ll > PROTO_MBULK_MAX_LEN) {
+			p->err = "Protocol error: invalid multibulk length";
+			return PROTO_ERR;
+		}
+		p->pos = newline - buf + 2;
+		// *0 和 *-1 当作空命令
+		if (ll <= 0) return PROTO_OK;
+		p->multibulklen = ll;
+		p->bulklen = -1;
+	}
+
+	while (p->multibulklen) {
+		if (p->bulklen == -1) {
+			newline = memchr(buf + p->pos, '\r', len - p->pos);
+			if (newline == NULL) {
+				if (len - p->pos > PROTO_INLINE_MAX_SIZE) {
+					p->err = "Protocol error: too big bulk count string";
+					return PROTO_ERR;
+				}
+				return PROTO_AGAIN;
+			}
+			if (newline + 1 >= buf + len) return PROTO_AGAIN;
+
+			if (buf[p->pos] != '$') {
+				p->err = "Protocol error: expected '$'";
+				return PROTO_ERR;
+			}
+			if (!protoParseLen(buf + p->pos + 1, newline, &ll) || ll < 0 || ll > PROTO_BULK_MAX_LEN) {
+				p->err = "Protocol error: invalid bulk length";
+				return PROTO_ERR;
+			}
+			p->pos = newline - buf + 2;
+			p->bulklen = ll;
+		}
+
+		// 参数内容加上结尾的 \r\n
+		if ((long long)(len - p->pos) < p->bulklen + 2) return PROTO_AGAIN;
+		protoAddArg(p, p->pos, p->bulklen);
+		p->pos += p->bulklen + 2;
+		p->bulklen = -1;
+		p->multibulklen--;
+	}
+	return PROTO_OK;
+}
+
+/*
+ * 从 buf 中解析下一条命令. 返回 PROTO_OK 时 argv/argc 指向解析出的参数,
+ * argc 可能为 0(空行), argv 在下一次调用或缓冲区变化前有效.
+ * 一次 read() 读到多条命令时反复调用直到返回 PROTO_AGAIN,
+ * 之后调用方丢弃缓冲区前 protoParserConsumed(p) 个字节并调用 protoParserShift.
+ */
+int protoParse(protoParser *p, const char *buf, size_t len, protoArg **argv, int *argc)
+{
+	int retval, j;
+
+	if (p->reqtype == PROTO_REQ_NONE) {
+		if (p->pos >= len) return PROTO_AGAIN;
+		p->reqtype = buf[p->pos] == '*' ? PROTO_REQ_MULTIBULK : PROTO_REQ_INLINE;
+		p->start = p->pos;
+		p->argc = 0;
+	}
+
+	if (p->reqtype == PROTO_REQ_MULTIBULK) {
+		retval = protoParseMultibulk(p, buf, len);
+	} else {
+		retval = protoParseInline(p, buf, len);
+	}
+	if (retval != PROTO_OK) return retval;
+
+	for (j = 0; j < p->argc; j++) {
+		p->argv[j].ptr = buf + p->offs[j];
+		p->argv[j].len = p->lens[j];
+	}
+	*argv = p->argv;
+	*argc = p->argc;
+	p->reqtype = PROTO_REQ_NONE;
+	p->multibulklen = 0;
+	p->bulklen = -1;
+	p->start = p->pos;
+	return PROTO_OK;
+}
+
+/* 调用方丢弃了缓冲区开头的 consumed 个字节 */
+void protoParserShift(protoParser *p, size_t consumed)
+{
+	int j;
+
+	p->pos -= consumed;
+	p->start -= consumed;
+	if (p->reqtype == PROTO_REQ_NONE) return;
+	for (j = 0; j < p->argc; j++) p->offs[j] -= consumed;
+}
+
+/* 回到 pos 处的命令边界, 之后的数据当作还没有解析 */
+void protoParserRewind(protoParser *p, size_t pos)
+{
+	p->reqtype = PROTO_REQ_NONE;
+	p->multibulklen = 0;
+	p->bulklen = -1;
+	p->pos = pos;
+	p->start = pos;
+	p->argc = 0;
+	p->err = NULL;
+}
+
+#if defined(REDIS_TEST) || defined(PROTO_TEST_MAIN)
+#include <stdio.h>
+#include <stdlib.h>
+#include "sds.h"
+#include "testhelp.h"
+
+#define UNUSED(x) (void)(x)
+
+/*
+ * 像客户端一样解析 input: 每次送入最多 chunk 字节, 其中第一次只送入 split 字节,
+ * 每轮解析完丢弃已经消费的部分. 解析出的命令写成 "arg|arg;" 的形式,
+ * 出错时追加 "ERR:<错误信息>". 参数不在缓冲区内部(发生了复制)时 *copied 置 1.
+ */
+static sds protoTestFeed(const char *input, size_t len, size_t split, size_t chunk, int *copied)
+{
+	protoParser p;
+	sds buf = sdsempty(), out = sdsempty();
+	size_t off = 0, n = split;
+	protoArg *argv;
+	int argc, j, retval = PROTO_AGAIN;
+
+	protoParserInit(&p);
+	while (off < len) {
+		size_t consumed;
+
+		if (n > len - off) n = len - off;
+		buf = sdscatlen(buf, input + off, n);
+		off += n;
+		while ((retval = protoParse(&p, buf, sdslen(buf), &argv, &argc)) == PROTO_OK) {
+			for (j = 0; j < argc; j++) {
+				if (argv[j].ptr < buf || argv[j].ptr + argv[j].len > buf + sdslen(buf)) *copied = 1;
+				if (j) out = sdscatlen(out, "|", 1);
+				out = sdscatlen(out, argv[j].ptr, argv[j].len);
+			}
+			out = sdscatlen(out, ";", 1);
+		}
+		if (retval == PROTO_ERR) {
+			out = sdscatprintf(out, "ERR:%s", p.err);
+			break;
+		}
+		if ((consumed = protoParserConsumed(&p)) > 0) {
+			sdsrange(buf, consumed, -1);
+			protoParserShift(&p, consumed);
+		}
+		n = chunk;
+	}
+	sdsfree(buf);
+	protoParserFree(&p);
+	return out;
+}
+
+/* 在每一个字节处切开输入, 以及逐字节送入, 结果都要等于 expected */
+static int protoTestSplits(const char *input, size_t len, const char *expected)
+{
+	size_t split;
+	int ok = 1, copied = 0;
+
+	for (split = 0; split <= len; split++) {
+		sds out = protoTestFeed(input, len, split, len, &copied);
+
+		if (strcmp(out, expected) != 0) {
+			printf("\n  split at %zu: got \"%s\"", split, out);
+			ok = 0;
+		}
+		sdsfree(out);
+	}
+	{
+		sds out = protoTestFeed(input, len, 1, 1, &copied);
+
+		if (strcmp(out, expected) != 0) {
+			printf("\n  byte by byte: got \"%s\"", out);
+			ok = 0;
+		}
+		sdsfree(out);
+	}
+	return ok && !copied;
+}
+
+#define protoTestCase(descr, input, expected) \
+	test_cond(descr, protoTestSplits(input, sizeof(input) - 1, expected))
+
+int protoTest(int argc, char **argv)
+{
+	UNUSED(argc);
+	UNUSED(argv);
+
+	protoTestCase("Multibulk requests split at every byte",
+		"*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n*1\r\n$4\r\nPING\r\n",
+		"SET|key|value;PING;")
+	protoTestCase("Inline requests split at every byte",
+		"SET key value\r\nPING\n  GET \t k  \r\n",
+		"SET|key|value;PING;GET|k;")
+	protoTestCase("Empty and binary bulk arguments",
+		"*3\r\n$4\r\nECHO\r\n$0\r\n\r\n$4\r\na\r\nb\r\n",
+		"ECHO||a\r\nb;")
+	protoTestCase("*0, *-1 and empty inline lines are empty commands",
+		"*0\r\n*-1\r\n\r\nPING\r\n",
+		";;;PING;")
+	protoTestCase("Inline and multibulk requests mixed in one pipeline",
+		"PING\r\n*2\r\n$3\r\nGET\r\n$1\r\nk\r\nQUIT\r\n",
+		"PING;GET|k;QUIT;")
+	protoTestCase("Invalid bulk length",
+		"*2\r\n$3\r\nGET\r\n$x\r\nk\r\n",
+		"ERR:Protocol error: invalid bulk length")
+	protoTestCase("Negative bulk length",
+		"*1\r\n$-1\r\n",
+		"ERR:Protocol error: invalid bulk length")
+	protoTestCase("Bulk length over the limit",
+		"*1\r\n$536870913\r\n",
+		"ERR:Protocol error: invalid bulk length")
+	protoTestCase("Invalid multibulk length",
+		"PING\r\n*1x\r\n",
+		"PING;ERR:Protocol error: invalid multibulk length")
+	protoTestCase("Multibulk length over the limit",
+		"*1048577\r\n",
+		"ERR:Protocol error: invalid multibulk length")
+	protoTestCase("Missing '$' before a bulk",
+		"*1\r\nPING\r\n",
+		"ERR:Protocol error: expected '$'")
+
+	{
+		size_t len = PROTO_INLINE_MAX_SIZE + 2;
+		char *big = zmalloc(len);
+		int copied = 0;
+		sds out;
+
+		memset(big, 'a', len);
+		out = protoTestFeed(big, len, len / 2, len, &copied);
+		test_cond("Inline request without a newline over the limit",
+			strcmp(out, "ERR:Protocol error: too big inline request") == 0)
+		sdsfree(out);
+		big[len - 1] = '\n';
+		out = protoTestFeed(big, len, len / 2, len, &copied);
+		test_cond("Long inline request completed by a newline",
+			sdslen(out) == len && out[len - 2] == 'a' && out[len - 1] == ';')
+		sdsfree(out);
+		zfree(big);
+	}
+
+	{
+		protoParser p;
+		protoArg *av;
+		int ac, retval;
+		sds buf = sdsnew("*1\r\n$4\r\nPING\r\n*2\r\n$3\r\nGET\r\n$1\r");
+		size_t consumed;
+
+		protoParserInit(&p);
+		retval = protoParse(&p, buf, sdslen(buf), &av, &ac);
+		test_cond("Parse the first of two pipelined commands",
+			retval == PROTO_OK && ac == 1 && av[0].ptr == buf + 8 && av[0].len == 4 &&
+			protoParserConsumed(&p) == 14 && p.pos == 14)
+		retval = protoParse(&p, buf, sdslen(buf), &av, &ac);
+		test_cond("Partial second command keeps its parsed arguments",
+			retval == PROTO_AGAIN && p.start == 14 && p.argc == 1 && p.offs[0] == 22 && p.pos == 27 &&
+			p.multibulklen == 1 && p.bulklen == -1)
+
+		consumed = protoParserConsumed(&p);
+		sdsrange(buf, consumed, -1);
+		protoParserShift(&p, consumed);
+		test_cond("Shift moves the state to the new buffer start",
+			p.start == 0 && p.pos == 13 && p.offs[0] == 8 && protoParserConsumed(&p) == 0)
+
+		buf = sdscat(buf, "\nk\r\n");
+		retval = protoParse(&p, buf, sdslen(buf), &av, &ac);
+		test_cond("\\r\\n split across reads completes after the shift",
+			retval == PROTO_OK && ac == 2 && av[0].ptr == buf + 8 && memcmp(av[0].ptr, "GET", 3) == 0 &&
+			av[1].len == 1 && av[1].ptr[0] == 'k' && protoParserConsumed(&p) == sdslen(buf))
+
+		protoParserRewind(&p, 0);
+		retval = protoParse(&p, buf, sdslen(buf), &av, &ac);
+		test_cond("Rewind parses the same command again",
+			retval == PROTO_OK && ac == 2 && av[0].len == 3 && av[1].ptr == buf + sdslen(buf) - 3 &&
+			protoParserConsumed(&p) == sdslen(buf))
+		retval = protoParse(&p, buf, sdslen(buf), &av, &ac);
+		test_cond("Nothing left after the last command",
+			retval == PROTO_AGAIN && p.reqtype == PROTO_REQ_NONE && p.pos == sdslen(buf))
+
+		protoParserReset(&p);
+		test_cond("Reset keeps the argument arrays",
+			p.pos == 0 && p.start == 0 && p.argc == 0 && p.argvcap == 8 && p.argv != NULL)
+		protoParserFree(&p);
+		sdsfree(buf);
+	}
+
+	test_report()
+	return 0;
+}
+#endif
+
+#ifdef PROTO_TEST_MAIN
+int main(int argc, char **argv)
+{
+	return protoTest(argc, argv);
+}
+#endif
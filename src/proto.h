@@ -0,0 +1,60 @@
+#ifndef __PROTO_H
+#define __PROTO_H
+
+#include <stddef.h>
+
+/* protoParse 的返回值 */
+#define PROTO_OK 0
+#define PROTO_AGAIN 1
+#define PROTO_ERR -1
+
+/* 请求类型 */
+#define PROTO_REQ_NONE 0
+#define PROTO_REQ_INLINE 1
+#define PROTO_REQ_MULTIBULK 2
+
+#define PROTO_INLINE_MAX_SIZE (1024*64)
+#define PROTO_MBULK_MAX_LEN (1024*1024)
+#define PROTO_BULK_MAX_LEN (512LL*1024*1024)
+
+/* 指向查询缓冲区内部的参数, 不以 '\0' 结尾 */
+typedef struct protoArg {
+	const char *ptr;
+	size_t len;
+} protoArg;
+
+/*
+ * 增量解析器: 数据不完整时返回 PROTO_AGAIN 并记住解析到的位置,
+ * 下次读到更多数据后从断点继续, 不会重新扫描已经解析过的部分.
+ */
+typedef struct protoParser {
+	int reqtype;
+	// 还没有读到的 bulk 数量, 为 0 时表示还没有读到 multibulk 头
+	long multibulklen;
+	// 当前 bulk 的长度, -1 表示还没有读到 bulk 头
+	long long bulklen;
+	// 下一个待解析的位置和当前命令的起始位置
+	size_t pos;
+	size_t start;
+	// 已解析参数在缓冲区中的偏移和长度, 缓冲区可能重新分配, 所以先记偏移
+	size_t *offs;
+	size_t *lens;
+	protoArg *argv;
+	int argc;
+	int argvcap;
+	const char *err;
+} protoParser;
+
+void protoParserInit(protoParser *p);
+void protoParserReset(protoParser *p);
+void protoParserFree(protoParser *p);
+int protoParse(protoParser *p, const char *buf, size_t len, protoArg **argv, int *argc);
+void protoParserShift(protoParser *p, size_t consumed);
+void protoParserRewind(protoParser *p, size_t pos);
+#define protoParserConsumed(p) ((p)->start)
+
+#ifdef REDIS_TEST
+int protoTest(int argc, char **argv);
+#endif
+
+#endif
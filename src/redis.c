@@ -1,8 +1,24 @@
 #include "redis.h"
 
 #include <locale.h>
+#include <signal.h>
 
-struct redisServer server;
+__thread struct redisServer server;
+struct sharedObjectsStruct shared;
+
+/*
+ * 命令表
+ * 名字, 实现函数, 参数个数(含命令名, -N 表示至少 N 个),
+ * 第一个键, 最后一个键, 键的步长, 标识
+ */
+struct redisCommand redisCommandTable[] = {
+	{"get", getCommand, 2, 1, 1, 1, 0},
+	{"set", setCommand, 3, 1, 1, 1, 0},
+	{"mget", mgetCommand, -2, 1, -1, 1, REDIS_CMD_SPLIT_GATHER},
+	{"del", delCommand, -2, 1, -1, 1, REDIS_CMD_SPLIT_SUM},
+	{"ping", pingCommand, -1, 0, 0, 0, 0},
+	{"echo", echoCommand, 2, 0, 0, 0, 0}
+};
 
 void redisOutOfMemoryHandler(size_t allocation_size)
 {
@@ -10,6 +26,67 @@ void redisOutOfMemoryHandler(size_t allocation_size)
 	redisPanic("Redis aborting for OUT OF MEMORY");
 }
 
+/*------------------------------------------------------------------
+ * 字典类型
+ *-----------------------------------------------------------------*/
+
+unsigned int dictSdsHash(const void *key)
+{
+	return dictGenHashFunction(key, sdslen((sds)key));
+}
+
+unsigned int dictSdsCaseHash(const void *key)
+{
+	return dictGenCaseHashFunction(key, sdslen((sds)key));
+}
+
+int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2)
+{
+	size_t l1 = sdslen((sds)key1), l2 = sdslen((sds)key2);
+
+	DICT_NOTUSED(privdata);
+	if (l1 != l2) return 0;
+	return memcmp(key1, key2, l1) == 0;
+}
+
+int dictSdsKeyCaseCompare(void *privdata, const void *key1, const void *key2)
+{
+	DICT_NOTUSED(privdata);
+	return strcasecmp(key1, key2) == 0;
+}
+
+void dictSdsDestructor(void *privdata, void *val)
+{
+	DICT_NOTUSED(privdata);
+	sdsfree(val);
+}
+
+void dictRedisObjectDestructor(void *privdata, void *val)
+{
+	DICT_NOTUSED(privdata);
+	if (val) decrRefCount(val);
+}
+
+/* 数据库: sds 键, 对象值 */
+dictType dbDictType = {
+	dictSdsHash,
+	NULL,
+	NULL,
+	dictSdsKeyCompare,
+	dictSdsDestructor,
+	dictRedisObjectDestructor
+};
+
+/* 命令表: 不区分大小写的 sds 键, redisCommand 值 */
+dictType commandTableDictType = {
+	dictSdsCaseHash,
+	NULL,
+	NULL,
+	dictSdsKeyCaseCompare,
+	dictSdsDestructor,
+	NULL
+};
+
 // 检查redis是否是哨兵模式运行
 int checkForSentinelMode(int argc, char **argv)
 {
@@ -23,8 +100,58 @@ int checkForSentinelMode(int argc, char **argv)
 	return 0;
 }
 
+void populateCommandTable(void)
+{
+	int numcommands = sizeof(redisCommandTable) / sizeof(struct redisCommand);
+	int j;
+
+	for (j = 0; j < numcommands; j++) {
+		struct redisCommand *c = redisCommandTable + j;
+
+		if (dictAdd(server.commands, sdsnew(c->name), c) != DICT_OK) {
+			redisPanic("Duplicate command in the command table");
+		}
+	}
+	// 之后命令表只读, 分片线程共享查找. 这里做完渐进式 rehash, 否则 dictFind 会顺带修改它
+	while (dictIsRehashing(server.commands)) dictRehash(server.commands, 100);
+}
+
+void createSharedObjects(void)
+{
+	shared.crlf = createObject(REDIS_STRING, sdsnew("\r\n"));
+	shared.ok = createObject(REDIS_STRING, sdsnew("+OK\r\n"));
+	shared.pong = createObject(REDIS_STRING, sdsnew("+PONG\r\n"));
+	shared.nullbulk = createObject(REDIS_STRING, sdsnew("$-1\r\n"));
+	shared.czero = createObject(REDIS_STRING, sdsnew(":0\r\n"));
+	shared.cone = createObject(REDIS_STRING, sdsnew(":1\r\n"));
+}
+
 void initServerConfig(void)
 {
+	server.config_hz = REDIS_DEFAULT_HZ;
+	server.hz = REDIS_DEFAULT_HZ;
+	server.dynamic_hz = REDIS_DEFAULT_DYNAMIC_HZ;
+	server.hz_min = REDIS_MIN_HZ;
+	server.hz_max = REDIS_MAX_HZ;
+	server.port = REDIS_SERVERPORT;
+	server.tcp_backlog = REDIS_TCP_BACKLOG;
+	server.bindaddr_count = 0;
+	server.unixsocket = NULL;
+	server.unixsocketperm = REDIS_DEFAULT_UNIX_SOCKET_PERM;
+	server.ipfd_count = 0;
+	server.sofd = -1;
+	server.maxidletime = REDIS_MAXIDLETIME;
+	server.tcpkeepalive = REDIS_DEFAULT_TCP_KEEPALIVE;
+	server.maxclients = REDIS_MAX_CLIENTS;
+	server.busy_poll_us = REDIS_DEFAULT_BUSY_POLL_US;
+	server.io_threads_num = REDIS_DEFAULT_IO_THREADS;
+	server.io_threads_do_reads = REDIS_DEFAULT_IO_THREADS_DO_READS;
+	server.shards = REDIS_DEFAULT_SHARDS;
+	memcpy(server.client_obuf_limits, clientBufferLimitsDefaults, sizeof(server.client_obuf_limits));
+	server.client_obuf_pause_reads = REDIS_DEFAULT_CLIENT_OBUF_PAUSE_READS;
+	server.zerocopy_threshold = REDIS_DEFAULT_ZEROCOPY_THRESHOLD;
+	server.shard_id = 0;
+	server.dbnum = REDIS_DEFAULT_DBNUM;
 	server.verbosity = REDIS_DEFAULT_VERBOSITY;
 	server.logfile = zstrdup(REDIS_DEFAULT_LOGFILE);
 	server.syslog_enabled = REDIS_DEFAULT_SYSLOG_ENABLED;
@@ -33,6 +160,10 @@ void initServerConfig(void)
 	/* 主从相关配置 */
 	server.masterhost = NULL;
 
+	// 命令表在读配置文件之前创建
+	server.commands = dictCreate(&commandTableDictType, NULL);
+	populateCommandTable();
+
 	/* Debugging */
 	server.assert_failed = "<no assertion failed>";
 	server.assert_file = "<no file>";
@@ -40,6 +171,254 @@ void initServerConfig(void)
 	server.bug_report_start = 0;
 }
 
+/*
+ * 根据负载调整 serverCron 的频率: 没有客户端也没有积压的后台任务时降到 hz_min,
+ * 客户端越多、后台任务积压越多频率越高. 后台任务的时间片随周期缩短而变小,
+ * 每秒占用的 CPU 不变, 只是每次停顿更短.
+ */
+void updateDynamicHz(void)
+{
+	unsigned long clients = listLength(server.clients);
+	int hz = server.config_hz, backlog = 0;
+	aeBgTask *task;
+
+	if (!server.dynamic_hz) {
+		hz = server.config_hz;
+	} else {
+		for (task = aeGetBgTasks(server.el); task; task = task->next) {
+			if (aeBgTaskLag(server.el, task)) backlog++;
+		}
+		if (clients == 0 && backlog == 0) {
+			hz = server.hz_min;
+		} else {
+			while (clients / hz > REDIS_CLIENTS_PER_TICK && hz < server.hz_max) hz *= 2;
+			while (backlog-- && hz < server.hz_max) hz *= 2;
+		}
+		if (hz > server.hz_max) hz = server.hz_max;
+		if (hz < server.hz_min) hz = server.hz_min;
+	}
+
+	if (hz != server.hz) {
+		redisLog(REDIS_DEBUG, "Changing hz from %d to %d (%lu clients)", server.hz, hz, clients);
+		server.hz = hz;
+		aeSetBgPeriod(server.el, 1000 / server.hz);
+	}
+}
+
+int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData)
+{
+	AE_NOTUSED(eventLoop);
+	AE_NOTUSED(id);
+	AE_NOTUSED(clientData);
+
+	server.unixtime = time(NULL);
+	updateDynamicHz();
+
+	// 忙轮询的自旋/阻塞时间占比
+	run_with_period(5000) {
+		if (server.busy_poll_us) {
+			aeBusyPoll *bp = aeGetBusyPoll(server.el);
+			unsigned long long total = bp->spinUs + bp->idleUs;
+
+			redisLog(REDIS_VERBOSE,
+				"Busy poll: window %lld usec, spin %.1f%%, %llu hits, %llu misses",
+				bp->windowUs, total ? (double)bp->spinUs * 100 / total : 0,
+				bp->spinHits, bp->spinMisses);
+		}
+	}
+
+	run_with_period(1000) {
+		clientsCron();
+	}
+
+	// 客户端数量和输出缓冲区占用的内存
+	run_with_period(5000) {
+		unsigned long long obuf = 0;
+		listNode *ln;
+		listIter li;
+
+		listRewind(server.clients, &li);
+		while ((ln = listNext(&li)) != NULL) obuf += getClientOutputBufferMemoryUsage(listNodeValue(ln));
+		redisLog(REDIS_VERBOSE, "%lu clients connected, %llu bytes in output buffers, %zu bytes in use",
+			listLength(server.clients), obuf, zmalloc_used_memory());
+	}
+
+	server.cronloops++;
+	return 1000 / server.hz;
+}
+
+/* 每次进入事件循环等待之前调用 */
+void beforeSleep(struct aeEventLoop *eventLoop)
+{
+	AE_NOTUSED(eventLoop);
+
+	// 先让 I/O 线程读取并执行命令, 产生的回复紧接着写出
+	handleClientsWithPendingReadsUsingThreads();
+	// 上一轮写出后恢复读取的客户端, 执行积压的命令, 回复和新读到的一起写出
+	handleClientsWithPendingResumes();
+	// 超过输出缓冲区限制的客户端在写之前释放, 它们的回复不再写出
+	freeClientsInAsyncFreeQueue();
+	handleClientsWithPendingWritesUsingThreads();
+	// 本轮写出时又有客户端恢复了读取, 积压的命令可能不会再有可读事件触发, 不能阻塞等待
+	aeSetDontWait(server.el, listLength(server.clients_pending_resume) != 0);
+}
+
+void initServer(void)
+{
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	server.pid = getpid();
+	createSharedObjects();
+	if (server.hz_min > server.hz_max) {
+		redisLog(REDIS_WARNING, "dynamic-hz-min is greater than dynamic-hz-max, using %d for both", server.hz_max);
+		server.hz_min = server.hz_max;
+	}
+	if (server.shards > 1 && server.io_threads_num > 1) {
+		redisLog(REDIS_WARNING, "io-threads is ignored when shards is greater than 1");
+		server.io_threads_num = 1;
+	}
+
+	initServerLoop();
+	initThreadedIO();
+	startShards();
+}
+
+/*
+ * 初始化当前线程的事件循环、客户端列表、数据库和监听套接字.
+ * 分片模式下每个分片线程各调用一次, 这里设置的字段就是分片私有的全部状态.
+ */
+void initServerLoop(void)
+{
+	int j;
+
+	server.cronloops = 0;
+	server.unixtime = time(NULL);
+	server.clients = listCreate();
+	server.clients_pending_write = listCreate();
+	server.clients_pending_read = listCreate();
+	server.clients_to_close = listCreate();
+	server.clients_pending_resume = listCreate();
+	initClientPools();
+	// 各分片的客户端 id 互不重复
+	server.next_client_id = server.shard_id + 1;
+	server.stat_numconnections = 0;
+	server.stat_rejected_conn = 0;
+	server.ipfd_count = 0;
+	server.sofd = -1;
+	server.hz = server.dynamic_hz ? server.hz_min : server.config_hz;
+	server.el = aeCreateEventLoop(server.maxclients + REDIS_EVENTLOOP_FDSET_INCR);
+	if (server.el == NULL) {
+		redisLog(REDIS_WARNING, "Failed creating the event loop. Error message: '%s'",
+			strerror(errno));
+		exit(1);
+	}
+	server.db = zmalloc(sizeof(redisDb) * server.dbnum);
+	for (j = 0; j < server.dbnum; j++) {
+		server.db[j].dict = dictCreate(&dbDictType, NULL);
+		server.db[j].id = j;
+	}
+	aeSetBusyPoll(server.el, server.busy_poll_us);
+	// rehash、过期键清理等后台任务与 serverCron 同频率调度
+	aeSetBgPeriod(server.el, 1000 / server.hz);
+	aeSetBeforeSleepProc(server.el, beforeSleep);
+
+	if (server.port != 0 && listenToPort(server.port, server.ipfd, &server.ipfd_count) == REDIS_ERR) {
+		exit(1);
+	}
+	// Unix 套接字只由 0 号分片监听
+	if (server.unixsocket != NULL && server.shard_id == 0) {
+		unlink(server.unixsocket);
+		server.sofd = anetUnixServer(server.neterr, server.unixsocket, server.unixsocketperm, server.tcp_backlog);
+		if (server.sofd == ANET_ERR) {
+			redisLog(REDIS_WARNING, "Opening Unix socket: %s", server.neterr);
+			exit(1);
+		}
+		anetNonBlock(NULL, server.sofd);
+	}
+	if (server.ipfd_count == 0 && server.sofd < 0 && server.shard_id == 0) {
+		redisLog(REDIS_WARNING, "Configured to not listen anywhere, exiting.");
+		exit(1);
+	}
+
+	if (aeCreateTimeEvent(server.el, 1, serverCron, NULL, NULL) == AE_ERR) {
+		redisPanic("Can't create the serverCron time event.");
+		exit(1);
+	}
+
+	for (j = 0; j < server.ipfd_count; j++) {
+		if (aeCreateFileEvent(server.el, server.ipfd[j], AE_READABLE, acceptTcpHandler, NULL) == AE_ERR) {
+			redisPanic("Unrecoverable error creating server.ipfd file event.");
+		}
+	}
+	if (server.sofd > 0 && aeCreateFileEvent(server.el, server.sofd, AE_READABLE, acceptUnixHandler, NULL) == AE_ERR) {
+		redisPanic("Unrecoverable error creating server.sofd file event.");
+	}
+}
+
+struct redisCommand *lookupCommand(const char *name, size_t len)
+{
+	struct redisCommand *cmd;
+	tmpKey tk;
+
+	cmd = dictFetchValue(server.commands, tmpKeyInit(&tk, name, len));
+	tmpKeyFree(&tk);
+	return cmd;
+}
+
+/*
+ * 执行客户端当前的命令, 参数在 c->argv 中, 回复追加到客户端的输出缓冲区.
+ * cmd 是调用方已经查到的命令, 为 NULL 时按 argv[0] 查找.
+ * QUIT 之后客户端不再执行命令时返回 REDIS_ERR.
+ */
+int processCommand(redisClient *c, struct redisCommand *cmd)
+{
+	if (cmd == NULL && c->argv[0].len == 4 && !strncasecmp(c->argv[0].ptr, "quit", 4)) {
+		addReply(c, shared.ok);
+		c->flags |= REDIS_CLOSE_AFTER_REPLY;
+		return REDIS_ERR;
+	}
+
+	if (cmd == NULL) cmd = lookupCommand(c->argv[0].ptr, c->argv[0].len);
+	if (cmd == NULL) {
+		addReplyErrorFormat(c, "unknown command '%.*s'",
+			c->argv[0].len > 128 ? 128 : (int)c->argv[0].len, c->argv[0].ptr);
+		return REDIS_OK;
+	}
+	if ((cmd->arity > 0 && cmd->arity != c->argc) || (c->argc < -cmd->arity)) {
+		addReplyErrorFormat(c, "wrong number of arguments for '%s' command", cmd->name);
+		return REDIS_OK;
+	}
+
+	// 键不都属于当前分片时转发给所属的分片执行
+	if (server.shards > 1 && cmd->firstkey && shardRouteCommand(c, cmd) == REDIS_OK) return REDIS_OK;
+
+	cmd->proc(c);
+	return REDIS_OK;
+}
+
+/*------------------------------------------------------------------
+ * 服务器命令
+ *-----------------------------------------------------------------*/
+
+void pingCommand(redisClient *c)
+{
+	if (c->argc > 2) {
+		addReplyErrorFormat(c, "wrong number of arguments for '%s' command", "ping");
+		return;
+	}
+	if (c->argc == 1) {
+		addReply(c, shared.pong);
+	} else {
+		addReplyBulkCBuffer(c, c->argv[1].ptr, c->argv[1].len);
+	}
+}
+
+void echoCommand(redisClient *c)
+{
+	addReplyBulkCBuffer(c, c->argv[1].ptr, c->argv[1].len);
+}
+
 void redisLogRaw(int level, const char *msg)
 {
 	const int syslogLevelMap[] = { LOG_DEBUG, LOG_INFO, LOG_NOTICE, LOG_WARNING };
@@ -186,6 +565,12 @@ int main(int argc, char **argv)
 	} else {
 		redisLog(REDIS_WARNING, "Warning: no config file specifiled, using the default config. In order to specify a config file use %s /path/to/%s.conf", argv[0], server.sentinel_mode ? "sentinel" : "redis");
 	}
-	
+
+	initServer();
+	if (server.busy_poll_us) {
+		redisLog(REDIS_NOTICE, "Event loop busy polling enabled, up to %lld usec", server.busy_poll_us);
+	}
+	aeMain(server.el);
+	aeDeleteEventLoop(server.el);
 	return 0;
 }
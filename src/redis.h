@@ -4,12 +4,16 @@
 #include "config.h"
 #include "fmacroc.h"
 
+#include "ae.h"
 #include "zmalloc.h"
 #include "release.h"
 #include "version.h"
 #include "dict.h"
+#include "adlist.h"
 #include "sds.h"
 #include "util.h"
+#include "proto.h"
+#include "pool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,6 +25,9 @@
 #include <time.h>
 #include <sys/time.h>
 #include <syslog.h>
+#include <stdint.h>
+
+#include "anet.h"
 
 /* Error codes */
 #define REDIS_OK 0
@@ -52,6 +59,89 @@
 #define REDIS_DEFAULT_SYSLOG_IDENT "redis"
 #define REDIS_DEFAULT_MAXMEMORY_SMAPLES 5
 #define REDIS_BINDADDR_MAX 16
+#define REDIS_DEFAULT_HZ 10
+#define REDIS_MIN_HZ 1
+#define REDIS_MAX_HZ 500
+#define REDIS_DEFAULT_DYNAMIC_HZ 1
+// 动态 hz 下每个 tick 最多负责的客户端数量, 超过就提高频率
+#define REDIS_CLIENTS_PER_TICK 200
+#define REDIS_SERVERPORT 6379
+#define REDIS_TCP_BACKLOG 511
+#define REDIS_MAX_CLIENTS 10000
+#define REDIS_MIN_RESERVED_FDS 32
+#define REDIS_EVENTLOOP_FDSET_INCR (REDIS_MIN_RESERVED_FDS+96)
+#define REDIS_DEFAULT_BUSY_POLL_US 0
+#define REDIS_DEFAULT_UNIX_SOCKET_PERM 0
+#define REDIS_DEFAULT_TCP_KEEPALIVE 0
+#define REDIS_MAXIDLETIME 0
+#define REDIS_IOBUF_LEN (1024*16)
+#define REDIS_MAX_QUERYBUF_LEN (1024*1024*1024)
+// 空闲超过这个秒数的客户端, 收回查询缓冲区中扩容留下的空闲部分
+#define REDIS_QUERYBUF_IDLE_SECS 2
+// 每次可读事件最多接受的连接数, 避免连接风暴时长时间阻塞事件循环
+#define REDIS_MAX_ACCEPTS_PER_CALL 1000
+#define REDIS_IP_STR_LEN 46
+#define REDIS_DEFAULT_DBNUM 16
+// 客户端内联回复缓冲区的大小, 也是回复链表中复制块的最小大小
+#define REDIS_REPLY_CHUNK_BYTES (1024*16)
+// 不小于这个长度的值在回复中只引用对象, 不复制内容
+#define REDIS_REPLY_REF_MIN_BYTES (1024*4)
+// 每次写事件最多写出的字节数和 iovec 数量, 避免一个客户端长时间占用事件循环
+#define REDIS_MAX_WRITE_PER_EVENT (1024*64)
+#define REDIS_REPLY_IOV_MAX 128
+// 流水线命令每批最多解析的命令数量和预取的键数量
+#define REDIS_PIPELINE_BATCH 16
+#define REDIS_PIPELINE_PREFETCH_KEYS 64
+#define REDIS_DEFAULT_IO_THREADS 1
+#define REDIS_DEFAULT_IO_THREADS_DO_READS 1
+#define REDIS_IO_THREADS_MAX_NUM 16
+#define REDIS_DEFAULT_SHARDS 1
+#define REDIS_MAX_SHARDS 64
+#define REDIS_DEFAULT_CLIENT_OBUF_PAUSE_READS 0
+// 零拷贝发送的最小块大小, 0 表示关闭; 零拷贝发送时单次最多写出的字节数
+#define REDIS_DEFAULT_ZEROCOPY_THRESHOLD 0
+#define REDIS_ZEROCOPY_MAX_WRITE (1024*512)
+
+/* 客户端标识 */
+#define REDIS_UNIX_SOCKET (1<<0)
+// 回复写完后关闭连接, 不再处理新的命令
+#define REDIS_CLOSE_AFTER_REPLY (1<<1)
+// 在 server.clients_pending_write 中, 等待 beforeSleep 写出回复
+#define REDIS_PENDING_WRITE (1<<2)
+// 在 server.clients_pending_read 中, 等待 I/O 线程读取
+#define REDIS_PENDING_READ (1<<3)
+// I/O 线程已经解析出一条命令, 参数在 argv 中
+#define REDIS_PENDING_COMMAND (1<<4)
+// 命令转发到了其他分片, 回复到达前不处理后续命令
+#define REDIS_SHARD_WAIT (1<<5)
+// 等待跨分片回复时连接已关闭, 回复到达后再回收客户端
+#define REDIS_SHARD_FREED (1<<6)
+// 从库和订阅客户端, 决定适用哪一类输出缓冲区限制
+#define REDIS_SLAVE (1<<7)
+#define REDIS_PUBSUB (1<<8)
+// 在 server.clients_to_close 中, 由 beforeSleep 释放
+#define REDIS_CLOSE_ASAP (1<<9)
+// 输出缓冲区超过软限制, 暂停读取直到回复写出
+#define REDIS_READ_PAUSED (1<<10)
+// 套接字开启了 SO_ZEROCOPY, 大对象的回复用 MSG_ZEROCOPY 发送
+#define REDIS_ZEROCOPY (1<<11)
+// 在 server.clients_pending_resume 中, 由 beforeSleep 执行暂停读取期间积压的命令
+#define REDIS_PENDING_RESUME (1<<12)
+
+/* 客户端类型, 每一类有各自的输出缓冲区限制 */
+#define REDIS_CLIENT_TYPE_NORMAL 0
+#define REDIS_CLIENT_TYPE_SLAVE 1
+#define REDIS_CLIENT_TYPE_PUBSUB 2
+#define REDIS_CLIENT_TYPE_COUNT 3
+
+/* 命令标识 */
+// 键分布在多个分片上时可以按分片拆开执行, 整数回复相加
+#define REDIS_CMD_SPLIT_SUM (1<<0)
+// 键分布在多个分片上时可以按分片拆开执行, 每个键一个回复, 按请求中的顺序拼回多条回复
+#define REDIS_CMD_SPLIT_GATHER (1<<1)
+
+/* 对象类型 */
+#define REDIS_STRING 0
 
 /* 主从同步的状态 */
 #define REDIS_REPL_NONE 0
@@ -61,6 +151,9 @@
 #define REDIS_REPL_TRANSFER 4
 #define REDIS_REPL_CONNECTED 5
 
+/* 按指定周期(毫秒)执行 serverCron 中的代码块 */
+#define run_with_period(_ms_) if ((_ms_ <= 1000/server.hz) || !(server.cronloops%((_ms_)/(1000/server.hz))))
+
 /* Debugging */
 #define redisAssert(_e) ((_e) ? (void)0 : (_redisAssert(#_e, __FILE__, __LINE__), _exit(1)))
 #define redisPanic(_e) _redisPanic(#_e, __FILE__, __LINE__), _exit(1)
@@ -73,6 +166,119 @@ struct saveparam {
 	int changes;
 };
 
+/* 引用计数的值对象, 字符串对象的 ptr 是 sds */
+typedef struct redisObject {
+	unsigned type:4;
+	int refcount;
+	void *ptr;
+} robj;
+
+typedef struct redisDb {
+	dict *dict;
+	int id;
+} redisDb;
+
+/*
+ * 回复链表中的一块. obj 不为 NULL 时引用一个字符串对象, 发送时直接指向对象的内容;
+ * 否则回复数据复制在 buf 中.
+ */
+typedef struct replyBlock {
+	robj *obj;
+	size_t size;
+	size_t used;
+	char buf[];
+} replyBlock;
+
+/* 已用 MSG_ZEROCOPY 发出、内核还没有通知完成的一次发送, 完成前持有对象的引用 */
+typedef struct zeroCopySend {
+	uint32_t id;
+	robj *obj;
+} zeroCopySend;
+
+typedef struct redisClient {
+	uint64_t id;
+	int fd;
+	int flags;
+	redisDb *db;
+	// 私有的查询缓冲区, 只在有不完整的命令时存在, 否则为 NULL; 读取和执行命令期间可能指向共享缓冲区
+	sds querybuf;
+	protoParser parser;
+	// 当前命令的参数, 指向 querybuf 内部, 命令执行完即失效
+	protoArg *argv;
+	int argc;
+	// 流水线预取时已经算出的第一个键的哈希值, 为 NULL 时由命令自己计算
+	const unsigned int *keyhash;
+	time_t ctime;
+	time_t lastinteraction;
+	// 空闲超时, maxidletime 为 0 时不设置
+	aeWheelTimer idleTimer;
+	// 在 server.clients 和等待读写的列表中的节点, 释放时 O(1) 删除
+	listNode *node;
+	listNode *pending_write_node;
+	listNode *pending_read_node;
+	listNode *close_asap_node;
+	listNode *pending_resume_node;
+	// I/O 线程中 read()/sendmsg() 的结果, 由主线程处理
+	ssize_t io_nread;
+	ssize_t io_nwritten;
+	int io_errno;
+	// 本次写用零拷贝发出的对象, 由主线程加入 zerocopy_pending
+	robj *io_zerocopy_obj;
+	// 等待完成通知的零拷贝发送(按 id 递增), 以及下一次发送的 id
+	list *zerocopy_pending;
+	uint32_t zerocopy_next_id;
+	// 开启零拷贝时复制的 server.zerocopy_threshold, I/O 线程中看不到主线程的 server
+	size_t zerocopy_threshold;
+	// 回复先写入 buf, 放不下或引用大对象时追加到 reply 链表, 发送时合并成一次 sendmsg
+	list *reply;
+	// reply 链表中的字节数, 以及这些块实际占用的内存(含块头和未用满的部分)
+	unsigned long long reply_bytes;
+	unsigned long long reply_memory;
+	// 输出缓冲区开始超过软限制的时间, 没有超过时为 0
+	time_t obuf_soft_limit_reached_time;
+	// buf 非空时是 buf 中已发送的字节数, 否则是 reply 链表第一块中已发送的字节数
+	size_t sentlen;
+	int bufpos;
+	char buf[REDIS_REPLY_CHUNK_BYTES];
+} redisClient;
+
+struct sharedObjectsStruct {
+	robj *crlf, *ok, *pong, *nullbulk, *czero, *cone, *syntaxerr;
+};
+
+/* 输出缓冲区的硬限制和软限制, 为 0 时不限制 */
+typedef struct clientBufferLimitsConfig {
+	unsigned long long hard_limit_bytes;
+	unsigned long long soft_limit_bytes;
+	time_t soft_limit_seconds;
+} clientBufferLimitsConfig;
+
+extern clientBufferLimitsConfig clientBufferLimitsDefaults[REDIS_CLIENT_TYPE_COUNT];
+
+typedef void redisCommandProc(redisClient *c);
+
+struct redisCommand {
+	char *name;
+	redisCommandProc *proc;
+	// 参数个数(含命令名), 负数 -N 表示至少 N 个
+	int arity;
+	// 第一个键、最后一个键的位置(负数从末尾算)和步长, 没有键时为 0
+	int firstkey;
+	int lastkey;
+	int keystep;
+	int flags;
+};
+
+/*
+ * 参数指向查询缓冲区且不以 '\0' 结尾, 查找字典时在栈上拼一个临时 sds,
+ * 只有超过 REDIS_TMPKEY_LEN 的键才分配内存.
+ */
+#define REDIS_TMPKEY_LEN 128
+typedef struct tmpKey {
+	sds key;
+	unsigned int space[(sizeof(struct sdshdr) + REDIS_TMPKEY_LEN + 1 + sizeof(unsigned int) - 1) / sizeof(unsigned int)];
+} tmpKey;
+
 struct redisServer {
 	/* General */
 	pid_t pid;
@@ -80,19 +286,61 @@ struct redisServer {
 	// 配置文件的绝对路径
 	char *configFile;
 	
-	// serverCron 每秒执行的次数
+	// serverCron 每秒执行的次数, 开启 dynamic_hz 时随负载在 hz_min ~ hz_max 之间调整
 	int hz;
+	int config_hz;
+	int dynamic_hz;
+	int hz_min;
+	int hz_max;
 
 	// 数据库
+	redisDb *db;
 	
 	// 命令表
 	dict *commands;
 	dict *orig_commands;
 	
 	// 事件状态
+	aeEventLoop *el;
+
+	// serverCron 执行次数
+	int cronloops;
+
+	// serverCron 中更新的秒级时间
+	time_t unixtime;
 	
 	/* Networking */
 	
+	// 已连接的客户端
+	list *clients;
+
+	// 有回复等待写出的客户端, 在 beforeSleep 中直接写, 写不完才注册可写事件
+	list *clients_pending_write;
+
+	// 等待 I/O 线程读取的客户端
+	list *clients_pending_read;
+
+	// 超过输出缓冲区限制, 等待释放的客户端
+	list *clients_to_close;
+
+	// 输出缓冲区降到软限制以下、恢复了读取的客户端, 积压的命令等 beforeSleep 执行
+	list *clients_pending_resume;
+
+	// 客户端结构体、标准大小的查询缓冲区和回复块的空闲池, 连接关闭后留给新连接复用
+	pool client_pool;
+	pool querybuf_pool;
+	pool reply_pool;
+	// 事件循环线程读取查询时共享的缓冲区, 客户端只在命令不完整时才有自己的缓冲区
+	sds querybuf_shared;
+
+	// I/O 线程数量(包括主线程), 为 1 时不启用
+	int io_threads_num;
+	int io_threads_do_reads;
+
+	// 分片数量和当前分片的编号, 为 1 时不分片
+	int shards;
+	int shard_id;
+
 	int port;
 
 	// tcp backlog 长度
@@ -107,6 +355,13 @@ struct redisServer {
 	// Unix 套接字
 	char *unixsocket;
 	mode_t unixsocketperm;
+
+	// 监听的 TCP 套接字和 Unix 套接字
+	int ipfd[REDIS_BINDADDR_MAX];
+	int ipfd_count;
+	int sofd;
+	char neterr[ANET_ERR_LEN];
+	uint64_t next_client_id;
 	
 	int sentinel_mode;
 
@@ -127,6 +382,9 @@ struct redisServer {
 	// 是否开启 SO_KEEPALIVE 选项
 	int tcpkeepalive;
 
+	// 事件循环忙轮询的最长自旋时间(微秒), 0 表示关闭
+	long long busy_poll_us;
+
 	int dbnum;
 
 	/* AOF 持久化 */
@@ -152,6 +410,16 @@ struct redisServer {
 	unsigned long long maxmemory;
 	int maxmemory_policy;
 	int maxmemory_samples;
+	clientBufferLimitsConfig client_obuf_limits[REDIS_CLIENT_TYPE_COUNT];
+	// 超过软限制时暂停读取, 而不是继续执行命令直到断开
+	int client_obuf_pause_reads;
+	// 不小于这个大小的引用对象用 MSG_ZEROCOPY 发送, 0 表示关闭
+	size_t zerocopy_threshold;
+
+	/* Stats */
+	long long stat_numconnections;
+	// 因超过 maxclients 被拒绝的连接数
+	long long stat_rejected_conn;
 
 	/*debug assert*/
 	char *assert_failed;
@@ -162,7 +430,13 @@ struct redisServer {
 };
 
 
-extern struct redisServer server;
+/*
+ * 每个线程一份. 分片模式下每个分片线程从主线程复制一份配置,
+ * 再初始化自己的事件循环、客户端和数据库, 分片之间不共享可变状态.
+ */
+extern __thread struct redisServer server;
+extern struct sharedObjectsStruct shared;
+extern dictType dbDictType;
 
 /* Core functions */
 #ifdef __GNUC__
@@ -183,6 +457,81 @@ void _redisAssert(char *estr, char *file, int line);
 void _redisPanic(char *msg, char *file, int line);
 void bugReportStart(void);
 
+/* networking.c -- Networking and Client related operations */
+redisClient *createClient(int fd, int flags);
+void freeClient(redisClient *c);
+void recycleClient(redisClient *c);
+void initClientPools(void);
+void clientsCron(void);
+void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask);
+int listenToPort(int port, int *fds, int *count);
+int processInputBuffer(redisClient *c);
+void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
+int handleClientsWithPendingWrites(void);
+void initThreadedIO(void);
+int handleClientsWithPendingReadsUsingThreads(void);
+int handleClientsWithPendingWritesUsingThreads(void);
+void addReply(redisClient *c, robj *obj);
+void addReplyString(redisClient *c, const char *s, size_t len);
+void addReplyBulk(redisClient *c, robj *obj);
+void addReplyBulkCBuffer(redisClient *c, const void *p, size_t len);
+void addReplyError(redisClient *c, const char *err);
+void addReplyStatus(redisClient *c, const char *status);
+void addReplyLongLong(redisClient *c, long long ll);
+void addReplyMultiBulkLen(redisClient *c, long length);
+sds takeClientReply(redisClient *c);
+int getClientType(redisClient *c);
+int getClientTypeByName(char *name);
+char *getClientTypeName(int class);
+unsigned long long getClientOutputBufferMemoryUsage(redisClient *c);
+int checkClientOutputBufferLimits(redisClient *c);
+void freeClientAsync(redisClient *c);
+void freeClientsInAsyncFreeQueue(void);
+int handleClientsWithPendingResumes(void);
+#ifdef __GNUC__
+void addReplyErrorFormat(redisClient *c, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+#else
+void addReplyErrorFormat(redisClient *c, const char *fmt, ...);
+#endif
+
+/* Redis object implementation */
+robj *createObject(int type, void *ptr);
+robj *createStringObject(const char *ptr, size_t len);
+void incrRefCount(robj *o);
+void decrRefCount(robj *o);
+void decrRefCountVoid(void *o);
+size_t stringObjectLen(robj *o);
+
+/* db.c -- Keyspace access API */
+sds tmpKeyInit(tmpKey *tk, const char *ptr, size_t len);
+void tmpKeyFree(tmpKey *tk);
+unsigned int dbHashKey(redisDb *db, const protoArg *key);
+robj *lookupKey(redisDb *db, const protoArg *key, const unsigned int *hash);
+void lookupKeys(redisDb *db, const protoArg *keys, int count, robj **vals);
+void setKey(redisDb *db, const protoArg *key, const unsigned int *hash, robj *val);
+int dbDelete(redisDb *db, const protoArg *key);
+
+/* Core functions */
+int processCommand(redisClient *c, struct redisCommand *cmd);
+struct redisCommand *lookupCommand(const char *name, size_t len);
+void initServerLoop(void);
+
+/* shard.c -- Shared-nothing shards */
+int keyShard(const char *key, size_t len);
+void startShards(void);
+int shardRouteCommand(redisClient *c, struct redisCommand *cmd);
+
+/* Commands prototypes */
+void pingCommand(redisClient *c);
+void echoCommand(redisClient *c);
+void getCommand(redisClient *c);
+void mgetCommand(redisClient *c);
+void setCommand(redisClient *c);
+void delCommand(redisClient *c);
+
 /* Configuration */
 void loadServerConfig(char *filename, char *options);
 void appendServerSaveParams(time_t seconds, int changes);
@@ -0,0 +1,348 @@
+#include "redis.h"
+#include "crc64.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+/*
+ * 无共享的分片模式
+ *
+ * shards 大于 1 时每个分片一个线程, 绑定到一个 CPU 核上, 各自拥有事件循环、客户端、
+ * 数据库和 zmalloc 计数槽(server 是线程局部变量). 各分片用 SO_REUSEPORT 监听同一个端口,
+ * 由内核分配连接. 键按 crc64 分到各个分片, 连接所在分片不拥有的键通过 ae 的任务队列
+ * 把命令转发给所属分片执行, 结果再发回原分片回复客户端. 等待期间客户端不处理后续命令,
+ * 保证同一个连接上的回复顺序.
+ *
+ * 多个键分布在多个分片上时, 只支持标记了 REDIS_CMD_SPLIT_SUM 的命令(如 DEL)
+ * 和 REDIS_CMD_SPLIT_GATHER 的命令(如 MGET), 按分片拆开并行执行, 前者整数回复相加,
+ * 后者按键在请求中的位置拼回多条回复. 这类命令在各分片之间不是原子的.
+ */
+
+typedef struct redisShard {
+	int id;
+	pthread_t thread;
+	aeEventLoop *el;
+} redisShard;
+
+/* 一次转发: 单个分片时回复原样转给客户端, 多个分片时汇总 */
+typedef struct shardBatch {
+	redisClient *c;
+	// 还没有回复的子请求数量
+	int pending;
+	int multi;
+	long long sum;
+	// 单分片的回复, 或者多分片时第一个非整数回复
+	sds reply;
+	// REDIS_CMD_SPLIT_GATHER: 按键在请求中的位置存放的单个回复
+	int numkeys;
+	sds *replies;
+} shardBatch;
+
+/* 发给一个分片的子请求, 参数是复制的, 不依赖发起方的查询缓冲区 */
+typedef struct shardRequest {
+	shardBatch *batch;
+	int origin;
+	int dbid;
+	struct redisCommand *cmd;
+	int argc;
+	sds *argv;
+	// REDIS_CMD_SPLIT_GATHER: argv[j] 这个键在原请求中是第 keypos[j-1] 个键
+	int *keypos;
+	sds reply;
+} shardRequest;
+
+static redisShard shards[REDIS_MAX_SHARDS];
+// 主线程初始化完成后的 server, 分片线程从这里复制配置
+static struct redisServer shardTemplate;
+static pthread_mutex_t shardReadyMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shardReadyCond = PTHREAD_COND_INITIALIZER;
+static int shardsReady = 0;
+
+// 在所属分片中代为执行转发来的命令
+static __thread redisClient *shardClient;
+
+int keyShard(const char *key, size_t len)
+{
+	// 不能用 dict 的哈希函数, 否则分片内的键在 dict 中只会落到 1/shards 的桶里
+	return crc64(0, (const unsigned char *)key, len) % server.shards;
+}
+
+/*------------------------------------------------------------------
+ * 启动
+ *-----------------------------------------------------------------*/
+
+static void shardPinToCpu(int id)
+{
+#ifdef __linux__
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	if (ncpu <= 0) return;
+	CPU_ZERO(&set);
+	CPU_SET(id % ncpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+		redisLog(REDIS_WARNING, "Can't pin shard %d to CPU %ld", id, id % ncpu);
+	}
+#else
+	((void) id);
+#endif
+}
+
+/* 当前线程的事件循环创建好以后调用, 完成后等待其余分片 */
+static void shardInitCommon(int id)
+{
+	shardPinToCpu(id);
+	if (aeCreateTaskQueue(server.el) == AE_ERR) {
+		redisLog(REDIS_WARNING, "Can't create the task queue of shard %d: %s", id, strerror(errno));
+		exit(1);
+	}
+	shardClient = createClient(-1, 0);
+	shards[id].id = id;
+	shards[id].el = server.el;
+
+	pthread_mutex_lock(&shardReadyMutex);
+	shardsReady++;
+	pthread_cond_broadcast(&shardReadyCond);
+	while (shardsReady < server.shards) pthread_cond_wait(&shardReadyCond, &shardReadyMutex);
+	pthread_mutex_unlock(&shardReadyMutex);
+}
+
+static void *shardMain(void *arg)
+{
+	int id = (int)(long)arg;
+
+	// 先切换到自己的内存计数槽, 之后的分配不再和其他分片竞争全局计数器
+	zmalloc_set_thread_counter(id + 1);
+	server = shardTemplate;
+	server.shard_id = id;
+	initServerLoop();
+	shardInitCommon(id);
+	aeMain(server.el);
+	return NULL;
+}
+
+/* 在主线程中调用, 主线程自己是 0 号分片 */
+void startShards(void)
+{
+	int j;
+
+	if (server.shards == 1) return;
+
+	shardTemplate = server;
+	zmalloc_set_thread_counter(1);
+	for (j = 1; j < server.shards; j++) {
+		if (pthread_create(&shards[j].thread, NULL, shardMain, (void *)(long)j) != 0) {
+			redisLog(REDIS_WARNING, "Fatal: Can't start shard %d", j);
+			exit(1);
+		}
+	}
+	shardInitCommon(0);
+	redisLog(REDIS_NOTICE, "Started %d shards", server.shards);
+}
+
+/*------------------------------------------------------------------
+ * 命令转发
+ *-----------------------------------------------------------------*/
+
+static shardRequest *createShardRequest(shardBatch *batch, redisClient *c, struct redisCommand *cmd)
+{
+	shardRequest *req = zmalloc(sizeof(*req));
+
+	req->batch = batch;
+	req->origin = server.shard_id;
+	req->dbid = c->db->id;
+	req->cmd = cmd;
+	req->argc = 0;
+	req->argv = zmalloc(sizeof(sds) * c->argc);
+	req->keypos = NULL;
+	req->reply = NULL;
+	return req;
+}
+
+static void freeShardRequest(shardRequest *req)
+{
+	int j;
+
+	for (j = 0; j < req->argc; j++) sdsfree(req->argv[j]);
+	zfree(req->argv);
+	zfree(req->keypos);
+	sdsfree(req->reply);
+	zfree(req);
+}
+
+/* 在所属分片中执行子请求, 回复记在 req->reply 中 */
+static void shardExecute(shardRequest *req)
+{
+	protoArg *argv = zmalloc(sizeof(protoArg) * req->argc);
+	int j;
+
+	for (j = 0; j < req->argc; j++) {
+		argv[j].ptr = req->argv[j];
+		argv[j].len = sdslen(req->argv[j]);
+	}
+	shardClient->db = &server.db[req->dbid];
+	shardClient->argv = argv;
+	shardClient->argc = req->argc;
+	req->cmd->proc(shardClient);
+	shardClient->argv = NULL;
+	shardClient->argc = 0;
+	zfree(argv);
+	// 对象的引用计数不是线程安全的, 大的值在这里复制一次
+	req->reply = takeClientReply(shardClient);
+}
+
+static void shardFinishBatch(shardBatch *batch)
+{
+	redisClient *c = batch->c;
+	int j;
+
+	c->flags &= ~REDIS_SHARD_WAIT;
+	if (c->flags & REDIS_SHARD_FREED) {
+		recycleClient(c);
+	} else {
+		if (batch->reply) {
+			addReplyString(c, batch->reply, sdslen(batch->reply));
+		} else if (batch->replies) {
+			addReplyMultiBulkLen(c, batch->numkeys);
+			for (j = 0; j < batch->numkeys; j++) {
+				addReplyString(c, batch->replies[j], sdslen(batch->replies[j]));
+			}
+		} else {
+			addReplyLongLong(c, batch->sum);
+		}
+		// 继续执行等待期间积压的命令
+		processInputBuffer(c);
+	}
+	if (batch->replies) {
+		for (j = 0; j < batch->numkeys; j++) sdsfree(batch->replies[j]);
+		zfree(batch->replies);
+	}
+	sdsfree(batch->reply);
+	zfree(batch);
+}
+
+/*
+ * 把子请求的多条回复(每个键一个批量回复)拆开, 放到各个键在原请求中的位置上.
+ * 回复由本进程的命令生成, 格式是可信的.
+ */
+static void shardGatherReply(shardRequest *req)
+{
+	shardBatch *batch = req->batch;
+	char *p = strchr(req->reply, '\n') + 1;
+	int j;
+
+	for (j = 1; j < req->argc; j++) {
+		char *start = p;
+		long long len = strtoll(p + 1, NULL, 10);
+
+		p = strchr(p, '\n') + 1;
+		if (len >= 0) p += len + 2;
+		batch->replies[req->keypos[j - 1]] = sdsnewlen(start, p - start);
+	}
+}
+
+/* 在发起分片中合并一个子请求的回复 */
+static void shardMergeReply(shardRequest *req)
+{
+	shardBatch *batch = req->batch;
+
+	if (!batch->multi) {
+		batch->reply = req->reply;
+		req->reply = NULL;
+	} else if (batch->replies && req->reply[0] == '*') {
+		shardGatherReply(req);
+	} else if (req->reply[0] == ':') {
+		batch->sum += strtoll(req->reply + 1, NULL, 10);
+	} else if (batch->reply == NULL) {
+		batch->reply = req->reply;
+		req->reply = NULL;
+	}
+	freeShardRequest(req);
+	if (--batch->pending == 0) shardFinishBatch(batch);
+}
+
+static void shardReplyProc(aeEventLoop *el, void *arg)
+{
+	AE_NOTUSED(el);
+	shardMergeReply(arg);
+}
+
+static void shardExecuteProc(aeEventLoop *el, void *arg)
+{
+	shardRequest *req = arg;
+
+	AE_NOTUSED(el);
+	shardExecute(req);
+	if (aePostTask(shards[req->origin].el, shardReplyProc, req) == AE_ERR) {
+		redisPanic("Can't post the reply back to the origin shard");
+	}
+}
+
+/*
+ * 命令的键都属于当前分片时返回 REDIS_ERR, 由调用方直接执行;
+ * 否则转发给所属分片(或者回复错误), 返回 REDIS_OK.
+ */
+int shardRouteCommand(redisClient *c, struct redisCommand *cmd)
+{
+	int count[REDIS_MAX_SHARDS] = {0};
+	int last = cmd->lastkey < 0 ? c->argc + cmd->lastkey : cmd->lastkey;
+	int j, s, owners = 0, owner = 0, numkeys = 0;
+	shardBatch *batch;
+
+	for (j = cmd->firstkey; j <= last; j += cmd->keystep) {
+		s = keyShard(c->argv[j].ptr, c->argv[j].len);
+		if (count[s]++ == 0) owners++;
+		owner = s;
+		numkeys++;
+	}
+	if (count[server.shard_id] == numkeys) return REDIS_ERR;
+	if (owners > 1 && !(cmd->flags & (REDIS_CMD_SPLIT_SUM | REDIS_CMD_SPLIT_GATHER))) {
+		addReplyError(c, "keys in request don't belong to the same shard");
+		return REDIS_OK;
+	}
+
+	batch = zmalloc(sizeof(*batch));
+	batch->c = c;
+	batch->pending = owners;
+	batch->multi = owners > 1;
+	batch->sum = 0;
+	batch->reply = NULL;
+	batch->numkeys = numkeys;
+	batch->replies = NULL;
+	if (owners > 1 && (cmd->flags & REDIS_CMD_SPLIT_GATHER)) {
+		batch->replies = zcalloc(sizeof(sds) * numkeys);
+	}
+	c->flags |= REDIS_SHARD_WAIT;
+
+	if (!batch->multi) {
+		shardRequest *req = createShardRequest(batch, c, cmd);
+
+		for (j = 0; j < c->argc; j++) req->argv[req->argc++] = sdsnewlen(c->argv[j].ptr, c->argv[j].len);
+		if (aePostTask(shards[owner].el, shardExecuteProc, req) == AE_ERR) {
+			redisPanic("Can't forward the command to the owner shard");
+		}
+		return REDIS_OK;
+	}
+
+	// 按分片拆开, 每个子请求只带自己的键, 并记下它们在原请求中的位置. 当前分片的部分直接执行
+	for (s = 0; s < server.shards; s++) {
+		shardRequest *req;
+
+		if (count[s] == 0) continue;
+		req = createShardRequest(batch, c, cmd);
+		if (batch->replies) req->keypos = zmalloc(sizeof(int) * count[s]);
+		req->argv[req->argc++] = sdsnewlen(c->argv[0].ptr, c->argv[0].len);
+		for (j = 1; j < c->argc; j++) {
+			if (keyShard(c->argv[j].ptr, c->argv[j].len) != s) continue;
+			if (req->keypos) req->keypos[req->argc - 1] = j - 1;
+			req->argv[req->argc++] = sdsnewlen(c->argv[j].ptr, c->argv[j].len);
+		}
+		if (s == server.shard_id) {
+			shardExecute(req);
+			shardMergeReply(req);
+		} else if (aePostTask(shards[s].el, shardExecuteProc, req) == AE_ERR) {
+			redisPanic("Can't forward the command to the owner shard");
+		}
+	}
+	return REDIS_OK;
+}
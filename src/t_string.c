@@ -0,0 +1,40 @@
+#include "redis.h"
+
+void getCommand(redisClient *c)
+{
+	robj *o = lookupKey(c->db, &c->argv[1], c->keyhash);
+
+	if (o == NULL) {
+		addReply(c, shared.nullbulk);
+		return;
+	}
+	// 大的值在回复中只增加引用计数, 不复制
+	addReplyBulk(c, o);
+}
+
+void mgetCommand(redisClient *c)
+{
+	robj *vals[DICT_FIND_BATCH];
+	int j, n;
+
+	addReplyMultiBulkLen(c, c->argc - 1);
+	for (j = 1; j < c->argc; j += n) {
+		int k;
+
+		n = c->argc - j < DICT_FIND_BATCH ? c->argc - j : DICT_FIND_BATCH;
+		lookupKeys(c->db, &c->argv[j], n, vals);
+		for (k = 0; k < n; k++) {
+			if (vals[k] == NULL) {
+				addReply(c, shared.nullbulk);
+			} else {
+				addReplyBulk(c, vals[k]);
+			}
+		}
+	}
+}
+
+void setCommand(redisClient *c)
+{
+	setKey(c->db, &c->argv[1], c->keyhash, createStringObject(c->argv[2].ptr, c->argv[2].len));
+	addReply(c, shared.ok);
+}
@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "ae.h"
+#include "zmalloc.h"
+
+/*
+ * ae 事件循环基准测试
+ * 每项结果输出一行 key=value, 便于脚本对比不同版本或不同后端:
+ *   bench=fanin api=epoll pairs=1000 fanin=100 ... ns_per_event=...
+ */
+
+static struct config {
+	int pairs;
+	int fanin;
+	int rounds;
+	int timers;
+	const char *only;
+} config;
+
+static long long fired = 0;
+static long long events = 0;
+
+static long long ustime(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static int shouldRun(const char *name)
+{
+	return config.only == NULL || !strcmp(config.only, name);
+}
+
+static int onceProc(struct aeEventLoop *eventLoop, long long id, void *clientData)
+{
+	AE_NOTUSED(eventLoop);
+	AE_NOTUSED(id);
+	AE_NOTUSED(clientData);
+	fired++;
+	return AE_NOMORE;
+}
+
+// 返回 0 表示下一轮立刻再次触发
+static int periodicProc(struct aeEventLoop *eventLoop, long long id, void *clientData)
+{
+	AE_NOTUSED(eventLoop);
+	AE_NOTUSED(id);
+	AE_NOTUSED(clientData);
+	fired++;
+	return 0;
+}
+
+static void pipeProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask)
+{
+	AE_NOTUSED(eventLoop);
+	AE_NOTUSED(fd);
+	AE_NOTUSED(clientData);
+	AE_NOTUSED(mask);
+}
+
+static void readProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask)
+{
+	char buf[64];
+	int nread;
+
+	AE_NOTUSED(eventLoop);
+	AE_NOTUSED(clientData);
+	AE_NOTUSED(mask);
+	if ((nread = read(fd, buf, sizeof(buf))) > 0) events += nread;
+}
+
+static void taskProc(struct aeEventLoop *eventLoop, void *arg)
+{
+	AE_NOTUSED(eventLoop);
+	AE_NOTUSED(arg);
+	fired++;
+}
+
+static void wheelProc(struct aeEventLoop *eventLoop, aeWheelTimer *timer)
+{
+	AE_NOTUSED(eventLoop);
+	AE_NOTUSED(timer);
+	fired++;
+}
+
+// 把打开文件数上限提到系统允许的最大值
+static int raiseFileLimit(int needed)
+{
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1) return 1024;
+	if (limit.rlim_cur < (rlim_t)needed) {
+		limit.rlim_cur = limit.rlim_max < (rlim_t)needed ? limit.rlim_max : (rlim_t)needed;
+		setrlimit(RLIMIT_NOFILE, &limit);
+		getrlimit(RLIMIT_NOFILE, &limit);
+	}
+	return (int)limit.rlim_cur;
+}
+
+/*
+ * pairs 个 socketpair 全部注册可读事件, 每轮向其中 fanin 个随机写入一个字节,
+ * 再驱动事件循环直到全部读完. 只统计事件循环的耗时.
+ */
+static void benchFanin(void)
+{
+	aeEventLoop *el;
+	int *fds, j, r, wakeups = 0;
+	long long start, elapsed = 0, expected = 0;
+
+	fds = zmalloc(sizeof(int) * config.pairs * 2);
+	el = aeCreateEventLoop(config.pairs * 2 + 128);
+	for (j = 0; j < config.pairs; j++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds + j * 2) == -1) {
+			fprintf(stderr, "socketpair: %s\n", strerror(errno));
+			exit(1);
+		}
+		aeCreateFileEvent(el, fds[j * 2], AE_READABLE, readProc, NULL);
+	}
+
+	events = 0;
+	for (r = 0; r < config.rounds; r++) {
+		for (j = 0; j < config.fanin; j++) {
+			if (write(fds[(rand() % config.pairs) * 2 + 1], "x", 1) == 1) expected++;
+		}
+		start = ustime();
+		while (events < expected) {
+			if (aeProcessEvents(el, AE_FILE_EVENTS | AE_DONT_WAIT) > 0) wakeups++;
+		}
+		elapsed += ustime() - start;
+	}
+	if (elapsed == 0) elapsed = 1;
+	printf("bench=fanin api=%s pairs=%d fanin=%d rounds=%d events=%lld wakeups=%d "
+		"events_per_sec=%.0f wakeups_per_sec=%.0f ns_per_event=%.1f\n",
+		aeGetApiName(), config.pairs, config.fanin, config.rounds, events, wakeups,
+		(double)events * 1000000 / elapsed, (double)wakeups * 1000000 / elapsed,
+		(double)elapsed * 1000 / (events ? events : 1));
+
+	aeDeleteEventLoop(el);
+	for (j = 0; j < config.pairs * 2; j++) close(fds[j]);
+	zfree(fds);
+}
+
+// 大量未到期定时器存在时, 每轮事件循环的开销
+static void benchIdleTimers(int iterations)
+{
+	aeEventLoop *el = aeCreateEventLoop(1024);
+	long long start, elapsed;
+	int fds[2], j;
+
+	if (pipe(fds) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	aeCreateFileEvent(el, fds[0], AE_READABLE, pipeProc, NULL);
+	for (j = 0; j < config.timers; j++) {
+		aeCreateTimeEvent(el, 3600000 + (rand() % 3600000), onceProc, NULL, NULL);
+	}
+
+	start = ustime();
+	for (j = 0; j < iterations; j++) {
+		aeProcessEvents(el, AE_ALL_EVENTS | AE_DONT_WAIT);
+	}
+	elapsed = ustime() - start;
+	printf("bench=idle-loop api=%s timers=%d iterations=%d ns_per_iteration=%.1f\n",
+		aeGetApiName(), config.timers, iterations, (double)elapsed * 1000 / iterations);
+
+	aeDeleteEventLoop(el);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+// 创建再删除定时器的开销
+static void benchCreateDelete(void)
+{
+	aeEventLoop *el = aeCreateEventLoop(1024);
+	long long *ids = zmalloc(sizeof(long long) * config.timers);
+	long long start, elapsed;
+	int j;
+
+	start = ustime();
+	for (j = 0; j < config.timers; j++) {
+		ids[j] = aeCreateTimeEvent(el, 1000 + (rand() % 100000), onceProc, NULL, NULL);
+	}
+	// 乱序删除, 覆盖堆中间位置的删除
+	for (j = config.timers - 1; j > 0; j--) {
+		int k = rand() % (j + 1);
+		long long id = ids[j];
+		ids[j] = ids[k];
+		ids[k] = id;
+	}
+	for (j = 0; j < config.timers; j++) {
+		aeDeleteTimeEvent(el, ids[j]);
+	}
+	elapsed = ustime() - start;
+	printf("bench=create-delete api=%s timers=%d ns_per_op=%.1f remaining=%d\n",
+		aeGetApiName(), config.timers, (double)elapsed * 1000 / (config.timers * 2),
+		aeGetTimeEventCount(el));
+
+	zfree(ids);
+	aeDeleteEventLoop(el);
+}
+
+// 大量定时器同时到期时的分发开销
+static void benchFireStorm(void)
+{
+	aeEventLoop *el = aeCreateEventLoop(1024);
+	long long start, elapsed;
+	int j;
+
+	for (j = 0; j < config.timers; j++) {
+		aeCreateTimeEvent(el, 0, onceProc, NULL, NULL);
+	}
+	fired = 0;
+	start = ustime();
+	aeProcessEvents(el, AE_TIME_EVENTS | AE_DONT_WAIT);
+	elapsed = ustime() - start;
+	printf("bench=fire-storm api=%s timers=%d fired=%lld ns_per_timer=%.1f\n",
+		aeGetApiName(), config.timers, fired, (double)elapsed * 1000 / config.timers);
+
+	aeDeleteEventLoop(el);
+}
+
+// 周期定时器反复触发: 回调加重新入堆的开销
+static void benchTimerDispatch(void)
+{
+	aeEventLoop *el = aeCreateEventLoop(1024);
+	long long start, elapsed;
+	int j, rounds = config.rounds / 10 + 1;
+
+	for (j = 0; j < config.timers; j++) {
+		aeCreateTimeEvent(el, 0, periodicProc, NULL, NULL);
+	}
+	fired = 0;
+	start = ustime();
+	for (j = 0; j < rounds; j++) {
+		aeProcessEvents(el, AE_TIME_EVENTS | AE_DONT_WAIT);
+	}
+	elapsed = ustime() - start;
+	printf("bench=timer-dispatch api=%s timers=%d rounds=%d fired=%lld "
+		"dispatch_per_sec=%.0f ns_per_dispatch=%.1f\n",
+		aeGetApiName(), config.timers, rounds, fired,
+		(double)fired * 1000000 / (elapsed ? elapsed : 1),
+		(double)elapsed * 1000 / (fired ? fired : 1));
+
+	aeDeleteEventLoop(el);
+}
+
+// 模拟客户端每次有请求时重置空闲超时: 时间轮与最小堆对比
+static void benchIdleReschedule(int numclients, int iterations)
+{
+	aeEventLoop *el = aeCreateEventLoop(1024);
+	aeWheelTimer *timers = zmalloc(sizeof(aeWheelTimer) * numclients);
+	long long *ids = zmalloc(sizeof(long long) * numclients);
+	long long start, elapsed;
+	int j;
+
+	for (j = 0; j < numclients; j++) {
+		aeWheelTimerInit(&timers[j], wheelProc, NULL);
+		aeWheelArm(el, &timers[j], 300000);
+	}
+	start = ustime();
+	for (j = 0; j < iterations; j++) {
+		aeWheelArm(el, &timers[rand() % numclients], 300000);
+	}
+	elapsed = ustime() - start;
+	printf("bench=idle-reschedule api=%s impl=wheel clients=%d ns_per_reschedule=%.1f\n",
+		aeGetApiName(), numclients, (double)elapsed * 1000 / iterations);
+
+	start = ustime();
+	for (j = 0; j < 100000; j++) {
+		aeProcessEvents(el, AE_TIME_EVENTS | AE_DONT_WAIT);
+	}
+	elapsed = ustime() - start;
+	printf("bench=idle-advance api=%s impl=wheel clients=%d ns_per_iteration=%.1f\n",
+		aeGetApiName(), numclients, (double)elapsed * 1000 / 100000);
+	aeDeleteEventLoop(el);
+
+	el = aeCreateEventLoop(1024);
+	for (j = 0; j < numclients; j++) {
+		ids[j] = aeCreateTimeEvent(el, 300000, onceProc, NULL, NULL);
+	}
+	start = ustime();
+	for (j = 0; j < iterations; j++) {
+		int k = rand() % numclients;
+		aeDeleteTimeEvent(el, ids[k]);
+		ids[k] = aeCreateTimeEvent(el, 300000, onceProc, NULL, NULL);
+	}
+	elapsed = ustime() - start;
+	printf("bench=idle-reschedule api=%s impl=heap clients=%d ns_per_reschedule=%.1f\n",
+		aeGetApiName(), numclients, (double)elapsed * 1000 / iterations);
+	aeDeleteEventLoop(el);
+
+	zfree(timers);
+	zfree(ids);
+}
+
+/*
+ * 开关统计不能影响任务队列: 关闭统计前投递的任务和之后投递的任务都要执行.
+ * 失败时返回 1.
+ */
+static int checkTaskQueueStats(void)
+{
+	aeEventLoop *el = aeCreateEventLoop(1024);
+	int j, ok;
+
+	fired = 0;
+	ok = aeCreateTaskQueue(el) == AE_OK;
+	aeEnableStats(el, 1);
+	ok = ok && aePostTask(el, taskProc, NULL) == AE_OK;
+	aeEnableStats(el, 0);
+	ok = ok && aePostTask(el, taskProc, NULL) == AE_OK;
+	for (j = 0; ok && fired < 2 && j < 1000; j++) {
+		aeProcessEvents(el, AE_FILE_EVENTS | AE_DONT_WAIT);
+	}
+	aeDeleteEventLoop(el);
+	ok = ok && fired == 2;
+	printf("check=task-queue-stats api=%s result=%s\n", aeGetApiName(), ok ? "ok" : "fail");
+	return !ok;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: ./testae [-p <pairs>] [-f <fanin>] [-r <rounds>] [-t <timers>] [-b <bench>]\n"
+		" -p <pairs>   number of socketpairs (default 1000)\n"
+		" -f <fanin>   sockets made readable per round (default 100)\n"
+		" -r <rounds>  rounds of the fanin benchmark (default 10000)\n"
+		" -t <timers>  number of timers (default 10000)\n"
+		" -b <bench>   only run one of: fanin, idle-loop, create-delete,\n"
+		"              fire-storm, timer-dispatch, idle-reschedule,\n"
+		"              task-queue-stats\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int j, limit, failed = 0;
+
+	config.pairs = 1000;
+	config.fanin = 100;
+	config.rounds = 10000;
+	config.timers = 10000;
+	config.only = NULL;
+
+	for (j = 1; j < argc; j++) {
+		int lastarg = (j == argc - 1);
+
+		if (!strcmp(argv[j], "-p") && !lastarg) {
+			config.pairs = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-f") && !lastarg) {
+			config.fanin = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-r") && !lastarg) {
+			config.rounds = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-t") && !lastarg) {
+			config.timers = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-b") && !lastarg) {
+			config.only = argv[++j];
+		} else {
+			usage();
+		}
+	}
+	if (config.pairs < 1 || config.fanin < 1 || config.rounds < 1 || config.timers < 1) usage();
+
+	limit = raiseFileLimit(config.pairs * 2 + 64);
+	if (config.pairs * 2 + 64 > limit) {
+		config.pairs = (limit - 64) / 2;
+		fprintf(stderr, "open files limit is %d, using %d socketpairs\n", limit, config.pairs);
+	}
+
+	srand(1234);
+	if (shouldRun("fanin")) benchFanin();
+	if (shouldRun("idle-loop")) benchIdleTimers(100000);
+	if (shouldRun("create-delete")) benchCreateDelete();
+	if (shouldRun("fire-storm")) benchFireStorm();
+	if (shouldRun("timer-dispatch")) benchTimerDispatch();
+	if (shouldRun("idle-reschedule")) benchIdleReschedule(config.timers * 5, 1000000);
+	if (shouldRun("task-queue-stats")) failed |= checkTaskQueueStats();
+	return failed;
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dict.h"
+#include "zmalloc.h"
+
+/*
+ * 字典查找和遍历的基准测试
+ * 用法: ./testdict [键数量]
+ * 对比逐个 dictFind 和 dictFindBatch, dictNext 和 dictNextPrefetch,
+ * 每项结果输出一行 key=value
+ */
+
+static long long ustime(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static unsigned int strHash(const void *key)
+{
+	return dictGenHashFunction(key, strlen(key));
+}
+
+static int strCompare(void *privdata, const void *key1, const void *key2)
+{
+	DICT_NOTUSED(privdata);
+	return strcmp(key1, key2) == 0;
+}
+
+static void strDestructor(void *privdata, void *key)
+{
+	DICT_NOTUSED(privdata);
+	zfree(key);
+}
+
+static dictType strDictType = {
+	strHash,
+	NULL,
+	NULL,
+	strCompare,
+	strDestructor,
+	NULL
+};
+
+static char *makeKey(long j)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "key:%ld", j);
+	return zstrdup(buf);
+}
+
+static void report(const char *bench, long ops, long long elapsed)
+{
+	if (elapsed == 0) elapsed = 1;
+	printf("bench=%s ops=%ld ops_per_sec=%.0f ns_per_op=%.1f\n",
+		bench, ops, (double)ops * 1000000 / elapsed, (double)elapsed * 1000 / ops);
+}
+
+int main(int argc, char **argv)
+{
+	long count = argc > 1 ? atol(argv[1]) : 2000000;
+	long lookups = count, j, found = 0;
+	dict *d = dictCreate(&strDictType, NULL);
+	char **keys = zmalloc(sizeof(char *) * lookups);
+	dictEntry *out[DICT_FIND_BATCH];
+	dictIterator *iter;
+	dictEntry *de;
+	long long start;
+
+	for (j = 0; j < count; j++) {
+		dictAdd(d, makeKey(j), (void *)j);
+	}
+	while (dictIsRehashing(d)) dictRehash(d, 1000);
+
+	// 随机查找, 一半的键不存在
+	srand(1);
+	for (j = 0; j < lookups; j++) keys[j] = makeKey(rand() % (count * 2));
+
+	start = ustime();
+	for (j = 0; j < lookups; j++) {
+		if (dictFind(d, keys[j])) found++;
+	}
+	report("find", lookups, ustime() - start);
+
+	start = ustime();
+	for (j = 0; j < lookups; j += DICT_FIND_BATCH) {
+		unsigned int n = lookups - j < DICT_FIND_BATCH ? lookups - j : DICT_FIND_BATCH, k;
+
+		found -= dictFindBatch(d, (const void **)keys + j, n, out);
+		for (k = 0; k < n; k++) {
+			if (out[k] && (long)dictGetVal(out[k]) != atol(keys[j + k] + 4)) {
+				fprintf(stderr, "dictFindBatch returned the wrong entry for %s\n", keys[j + k]);
+				return 1;
+			}
+		}
+	}
+	report("find_batch", lookups, ustime() - start);
+	if (found != 0) {
+		fprintf(stderr, "dictFind and dictFindBatch disagree\n");
+		return 1;
+	}
+
+	start = ustime();
+	iter = dictGetIterator(d);
+	for (j = 0; (de = dictNext(iter)) != NULL; j++) found += (long)dictGetVal(de) + ((char *)dictGetKey(de))[4];
+	dictReleaseIterator(iter);
+	report("iterate", j, ustime() - start);
+
+	start = ustime();
+	iter = dictGetIterator(d);
+	for (j = 0; (de = dictNextPrefetch(iter)) != NULL; j++) found -= (long)dictGetVal(de) + ((char *)dictGetKey(de))[4];
+	dictReleaseIterator(iter);
+	report("iterate_prefetch", j, ustime() - start);
+	if (found != 0 || j != count) {
+		fprintf(stderr, "dictNext and dictNextPrefetch disagree\n");
+		return 1;
+	}
+
+	start = ustime();
+	dictRelease(d);
+	report("release", count, ustime() - start);
+
+	for (j = 0; j < lookups; j++) zfree(keys[j]);
+	zfree(keys);
+	return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "proto.h"
+#include "zmalloc.h"
+
+/*
+ * RESP 请求解析基准测试
+ * 用法: ./testproto [命令数量]
+ * 每项结果输出一行 key=value
+ */
+
+static long long ustime(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+// 生成 count 条流水线的 SET 命令
+static char *buildRequests(int count, int inl, size_t *len)
+{
+	size_t cap = (size_t)count * 64 + 1, used = 0;
+	char *buf = zmalloc(cap);
+	int j;
+
+	for (j = 0; j < count; j++) {
+		char key[32];
+		int klen = snprintf(key, sizeof(key), "key:%d", j);
+
+		if (inl) {
+			used += snprintf(buf + used, cap - used, "SET %s value%d\r\n", key, j % 10);
+		} else {
+			used += snprintf(buf + used, cap - used, "*3\r\n$3\r\nSET\r\n$%d\r\n%s\r\n$6\r\nvalue%d\r\n",
+				klen, key, j % 10);
+		}
+	}
+	*len = used;
+	return buf;
+}
+
+/*
+ * 每次最多送入 chunk 字节, 模拟一次 read() 读到的数据,
+ * 处理完后像客户端一样丢弃已经解析的部分.
+ */
+static long long parseAll(const char *src, size_t srclen, size_t chunk, long long *args)
+{
+	protoParser p;
+	char *buf = zmalloc(chunk + PROTO_INLINE_MAX_SIZE);
+	size_t buflen = 0, off = 0;
+	long long commands = 0;
+	protoArg *argv;
+	int argc, retval;
+
+	protoParserInit(&p);
+	while (off < srclen) {
+		size_t n = srclen - off < chunk ? srclen - off : chunk;
+
+		memcpy(buf + buflen, src + off, n);
+		buflen += n;
+		off += n;
+		while ((retval = protoParse(&p, buf, buflen, &argv, &argc)) == PROTO_OK) {
+			commands++;
+			*args += argc;
+		}
+		if (retval == PROTO_ERR) {
+			fprintf(stderr, "%s\n", p.err);
+			exit(1);
+		}
+		if (protoParserConsumed(&p)) {
+			size_t consumed = protoParserConsumed(&p);
+			memmove(buf, buf + consumed, buflen - consumed);
+			buflen -= consumed;
+			protoParserShift(&p, consumed);
+		}
+	}
+	protoParserFree(&p);
+	zfree(buf);
+	return commands;
+}
+
+static void benchParse(int count, int inl, size_t chunk)
+{
+	size_t len;
+	char *buf = buildRequests(count, inl, &len);
+	long long start, elapsed, commands, args = 0;
+
+	start = ustime();
+	commands = parseAll(buf, len, chunk, &args);
+	elapsed = ustime() - start;
+	if (elapsed == 0) elapsed = 1;
+	printf("bench=parse type=%s chunk=%zu commands=%lld args=%lld "
+		"commands_per_sec=%.0f ns_per_command=%.1f mb_per_sec=%.1f\n",
+		inl ? "inline" : "multibulk", chunk, commands, args,
+		(double)commands * 1000000 / elapsed, (double)elapsed * 1000 / commands,
+		(double)len / elapsed);
+	zfree(buf);
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 1000000;
+	size_t chunks[] = {16, 1024, 16 * 1024, 1024 * 1024};
+	unsigned int j;
+
+	for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++) {
+		benchParse(count, 0, chunks[j]);
+	}
+	for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++) {
+		benchParse(count, 1, chunks[j]);
+	}
+	return 0;
+}
@@ -49,6 +49,32 @@ long long memtoll(const char *p, int *err)
 	return val * mul;
 }
 
+/*
+ * 把 value 转成十进制字符串写入 s, 返回写入的长度(不含结尾的 '\0'),
+ * 空间不够时截断.
+ */
+int ll2string(char *s, size_t len, long long value)
+{
+	char buf[32], *p;
+	unsigned long long v;
+	size_t l;
+
+	if (len == 0) return 0;
+	v = (value < 0) ? -(unsigned long long)value : (unsigned long long)value;
+	p = buf + 31;
+	do {
+		*p-- = '0' + (v % 10);
+		v /= 10;
+	} while (v);
+	if (value < 0) *p-- = '-';
+	p++;
+	l = 32 - (p - buf);
+	if (l + 1 > len) l = len - 1;
+	memcpy(s, p, l);
+	s[l] = '\0';
+	return l;
+}
+
 sds getAbsolutePath(char *filename)
 {
 	char cwd[1024];
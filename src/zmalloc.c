@@ -43,10 +43,20 @@ void zlibc_free(void *ptr) {
 } while(0)
 #endif
 
+/*
+ * 登记了计数槽的线程只写自己的槽, 不需要原子加, 多个线程之间也不会争用同一个缓存行.
+ * 槽由一个线程独占写入, 其他线程读取时用 relaxed load.
+ */
+#define update_zmalloc_counter(_n) \
+	__atomic_store_n(&zmalloc_counters[zmalloc_counter_id].used, \
+		zmalloc_counters[zmalloc_counter_id].used + (_n), __ATOMIC_RELAXED)
+
 #define update_zmalloc_stat_alloc(__n) do { \
 	size_t _n = (__n); \
 	if (_n & (sizeof(long) - 1)) _n += sizeof(long) - (_n & (sizeof(long) - 1)); \
-	if (zmalloc_thread_safe) { \
+	if (zmalloc_counter_id) { \
+		update_zmalloc_counter(_n); \
+	} else if (zmalloc_thread_safe) { \
 		update_zmalloc_stat_add(_n); \
 	} else { \
 		used_memory += _n; \
@@ -56,7 +66,9 @@ void zlibc_free(void *ptr) {
 #define update_zmalloc_stat_free(__n) do { \
 	size_t _n = (__n); \
 	if (_n & (sizeof(long) - 1)) _n += sizeof(long) - (_n & (sizeof(long) - 1)); \
-	if (zmalloc_thread_safe) { \
+	if (zmalloc_counter_id) { \
+		update_zmalloc_counter(-_n); \
+	} else if (zmalloc_thread_safe) { \
 		update_zmalloc_stat_sub(_n); \
 	} else { \
 		used_memory -= _n; \
@@ -65,6 +77,15 @@ void zlibc_free(void *ptr) {
 
 static size_t used_memory = 0;
 static int zmalloc_thread_safe = 0;
+
+/* 每个计数槽独占一个缓存行, 0 号不用, 表示线程没有登记 */
+typedef struct zmallocCounter {
+	size_t used;
+	char pad[64 - sizeof(size_t)];
+} zmallocCounter;
+
+static zmallocCounter zmalloc_counters[ZMALLOC_MAX_COUNTERS + 1];
+static __thread int zmalloc_counter_id = 0;
 pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void zmalloc_default_oom(size_t size) {
@@ -168,6 +189,7 @@ char *zstrdup(const char *s) {
 
 size_t zmalloc_used_memory(void) {
 	size_t um;
+	int j;
 	if (zmalloc_thread_safe) {
 #if defined(__ATOMIC_RELAXED) || defined(HAVA_ATOMIC)
 		um = update_zmalloc_stat_add(0);
@@ -179,10 +201,30 @@ size_t zmalloc_used_memory(void) {
 	} else {
 		um = used_memory;
 	}
+	for (j = 1; j <= ZMALLOC_MAX_COUNTERS; j++) {
+		um += __atomic_load_n(&zmalloc_counters[j].used, __ATOMIC_RELAXED);
+	}
 
 	return um;
 }
 
+/*
+ * 当前线程之后的分配和释放记到 id 号槽中(1 ~ ZMALLOC_MAX_COUNTERS).
+ * 在一个线程中分配、另一个线程中释放的内存记在释放方, 所以单个槽的值只有求和才有意义,
+ * 可能暂时"为负".
+ */
+void zmalloc_set_thread_counter(int id) {
+	if (id < 0 || id > ZMALLOC_MAX_COUNTERS) return;
+	zmalloc_counters[id].used = 0;
+	zmalloc_counter_id = id;
+}
+
+/* id 号槽的净分配字节数 */
+ssize_t zmalloc_counter_used_memory(int id) {
+	if (id < 1 || id > ZMALLOC_MAX_COUNTERS) return 0;
+	return (ssize_t)__atomic_load_n(&zmalloc_counters[id].used, __ATOMIC_RELAXED);
+}
+
 void zmalloc_enable_thread_safeness(void) {
 	zmalloc_thread_safe = 1;
 }
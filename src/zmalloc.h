@@ -20,6 +20,11 @@
 #define ZMALLOC_LIB "libc"
 #endif
 
+#include <sys/types.h>
+
+/* 按线程分开统计内存时最多的计数槽数量 */
+#define ZMALLOC_MAX_COUNTERS 64
+
 void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
@@ -34,6 +39,8 @@ size_t zmalloc_get_smap_bytes_by_field(char *field);
 size_t zmalloc_get_memory_size(void);
 void zlibc_free(void *ptr);
 void zmalloc_enable_thread_safeness(void);
+void zmalloc_set_thread_counter(int id);
+ssize_t zmalloc_counter_used_memory(int id);
 
 #ifndef HAVE_MALLOC_SIZE
 size_t zmalloc_size(void *ptr);